@@ -0,0 +1,343 @@
+/* archive.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_ARCHIVE_H_
+#define SYMBOL_SLASHER_ARCHIVE_H_
+
+#include "pool.h"
+#include "relocatable.h"
+#include "sniff.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Static archives in the common (System V and GNU) format: a magic string,
+// then members that each start with a 60 byte text header.  The symbol index
+// and the table of long member names are members with special names.
+
+namespace slasher {
+
+bool is_archive(const std::vector<uint8_t> &content) {
+  return content.size() >= archive_magic_size &&
+         std::memcmp(content.data(), archive_magic, archive_magic_size) == 0;
+}
+
+struct Archive {
+  static constexpr std::size_t header_size = 60;
+  static constexpr std::size_t size_field = 48, size_width = 10;
+
+  enum Kind { index, names, file };
+
+  struct Member {
+    Kind kind;
+    std::string name;
+    // Offsets of the header and the content
+    std::size_t header;
+    std::size_t offset;
+    std::size_t size;
+    bool relocatable;
+  };
+
+  explicit Archive(const std::vector<uint8_t> &content) {
+    if (content.size() >= archive_magic_size &&
+        std::memcmp(content.data(), thin_archive_magic, archive_magic_size) ==
+            0)
+      throw std::logic_error("thin archives are not supported");
+    if (!is_archive(content))
+      throw std::logic_error("not an archive");
+
+    std::unordered_map<std::size_t, std::size_t> member_at;
+    std::size_t long_names = members_end;
+    for (std::size_t offset = archive_magic_size; offset < content.size();) {
+      if (content.size() - offset < header_size ||
+          std::memcmp(&content[offset + 58], "`\n", 2) != 0)
+        throw std::logic_error("truncated archive member header");
+      std::string name(reinterpret_cast<const char *>(&content[offset]), 16);
+      name.erase(name.find_last_not_of(' ') + 1);
+      Member member{file,
+                    name,
+                    offset,
+                    offset + header_size,
+                    size(content, offset),
+                    false};
+      if (member.size > content.size() - member.offset)
+        throw std::logic_error("truncated archive member " + name);
+
+      if (name == "/" || name == "/SYM64/") {
+        member.kind = index;
+        index_width = name == "/" ? 4 : 8;
+      } else if (name == "//") {
+        member.kind = names;
+        long_names = members.size();
+      } else if (name.rfind("__.SYMDEF", 0) == 0 || name.rfind("#1/", 0) == 0) {
+        throw std::logic_error("BSD archives are not supported");
+      } else if (name.size() > 1 && name[0] == '/') {
+        member.name = long_name(content, long_names, name);
+      } else if (!name.empty() && name.back() == '/') {
+        member.name.pop_back();
+      }
+      member.relocatable = member.kind == file &&
+                           is_relocatable(&content[member.offset], member.size);
+
+      member_at[offset] = members.size();
+      members.push_back(member);
+      // Members are aligned to two bytes
+      offset = member.offset + member.size + (member.size & 1);
+    }
+
+    for (const auto &member : members) {
+      if (member.kind != index)
+        continue;
+      auto data = &content[member.offset];
+      auto count = read_offset(data, member.size, 0);
+      if (count >= member.size / index_width)
+        throw std::logic_error("truncated archive symbol index");
+      auto strings = index_width * (count + 1);
+      for (uint64_t i = 0; i < count; i++) {
+        auto target =
+            member_at.find(read_offset(data, member.size, index_width * (i + 1)));
+        if (target == member_at.end())
+          throw std::logic_error("archive symbol index refers to no member");
+        auto name = reinterpret_cast<const char *>(data + strings);
+        auto length = strnlen(name, member.size - strings);
+        symbols.emplace_back(std::string(name, length), target->second);
+        strings = std::min(strings + length + 1, member.size);
+      }
+    }
+  }
+
+  // Writes the archive with new content for the members given, and with the
+  // names in the symbol index of relocatable members passed through rename.
+  // Other members are copied as they are.
+  template <typename Rename>
+  std::vector<uint8_t>
+  write(const std::vector<uint8_t> &content,
+        const std::vector<std::optional<std::vector<uint8_t>>> &replaced,
+        const Rename &rename) const {
+    std::vector<std::string> names;
+    std::size_t strings = 0;
+    for (const auto &[name, member] : symbols) {
+      names.push_back(members[member].relocatable ? rename(name) : name);
+      strings += names.back().size() + 1;
+    }
+    auto member_size = [&](std::size_t i) {
+      return replaced[i] ? replaced[i]->size() : members[i].size;
+    };
+    auto padded = [](std::size_t size) { return size + (size & 1); };
+
+    // Offsets in the index depend on the size of the index, and the index
+    // switches to 64 bit offsets if a 32 bit offset would overflow
+    std::vector<std::size_t> headers(members.size());
+    auto width = index_width;
+    std::size_t index_size = 0;
+    for (;;) {
+      index_size = width * (symbols.size() + 1) + strings;
+      std::size_t offset = archive_magic_size;
+      for (std::size_t i = 0; i < members.size(); i++) {
+        headers[i] = offset;
+        offset += header_size +
+                  padded(members[i].kind == index ? index_size : member_size(i));
+      }
+      if (width == 8 || offset <= std::numeric_limits<uint32_t>::max())
+        break;
+      width = 8;
+    }
+
+    std::vector<uint8_t> out(content.begin(),
+                             content.begin() + archive_magic_size);
+    out.reserve(headers.empty() ? out.size()
+                                : headers.back() + header_size +
+                                      member_size(members.size() - 1) + 1);
+    for (std::size_t i = 0; i < members.size(); i++) {
+      const auto &member = members[i];
+      auto header = out.size();
+      out.insert(out.end(), content.begin() + member.header,
+                 content.begin() + member.offset);
+      if (member.kind == index) {
+        put_field(out, header, 16, width == 4 ? "/" : "/SYM64/");
+        put_field(out, header + size_field, size_width,
+                  std::to_string(index_size));
+        put_offset(out, width, symbols.size());
+        for (const auto &entry : symbols)
+          put_offset(out, width, headers[entry.second]);
+        for (const auto &name : names) {
+          out.insert(out.end(), name.begin(), name.end());
+          out.push_back(0);
+        }
+      } else if (replaced[i]) {
+        put_field(out, header + size_field, size_width,
+                  std::to_string(replaced[i]->size()));
+        out.insert(out.end(), replaced[i]->begin(), replaced[i]->end());
+      } else {
+        out.insert(out.end(), content.begin() + member.offset,
+                   content.begin() + member.offset + member.size);
+      }
+      if (out.size() & 1)
+        out.push_back('\n');
+    }
+    return out;
+  }
+
+  std::vector<Member> members;
+
+  // Each name in the symbol index and the member defining it
+  std::vector<std::pair<std::string, std::size_t>> symbols;
+  std::size_t index_width = 4;
+
+private:
+  static constexpr std::size_t members_end = std::size_t(-1);
+
+  static std::size_t size(const std::vector<uint8_t> &content,
+                          std::size_t header) {
+    std::size_t value = 0;
+    for (auto i = header + size_field;
+         i < header + size_field + size_width && content[i] != ' '; i++) {
+      if (content[i] < '0' || content[i] > '9')
+        throw std::logic_error("bad archive member size");
+      value = value * 10 + (content[i] - '0');
+    }
+    return value;
+  }
+
+  // Long names are kept in the names member as "name/\n", and referred to by
+  // their offset as "/offset"
+  std::string long_name(const std::vector<uint8_t> &content,
+                        std::size_t long_names, const std::string &name) const {
+    if (long_names == members_end ||
+        name.find_first_not_of("0123456789", 1) != std::string::npos)
+      throw std::logic_error("bad archive member name " + name);
+    const auto &table = members[long_names];
+    auto start = std::stoull(name.substr(1));
+    if (start >= table.size)
+      throw std::logic_error("bad archive member name " + name);
+    auto begin = reinterpret_cast<const char *>(&content[table.offset]);
+    auto end = static_cast<const char *>(
+        std::memchr(begin + start, '\n', table.size - start));
+    std::string result(begin + start, end ? end : begin + table.size);
+    if (!result.empty() && result.back() == '/')
+      result.pop_back();
+    return result;
+  }
+
+  uint64_t read_offset(const uint8_t *data, std::size_t size,
+                       std::size_t offset) const {
+    if (offset + index_width > size)
+      throw std::logic_error("truncated archive symbol index");
+    uint64_t value = 0;
+    for (std::size_t i = 0; i < index_width; i++)
+      value = value << 8 | data[offset + i];
+    return value;
+  }
+
+  static void put_offset(std::vector<uint8_t> &out, std::size_t width,
+                         uint64_t value) {
+    for (std::size_t i = width; i-- > 0;)
+      out.push_back(uint8_t(value >> (8 * i)));
+  }
+
+  static void put_field(std::vector<uint8_t> &out, std::size_t offset,
+                        std::size_t width, const std::string &value) {
+    if (value.size() > width)
+      throw std::logic_error("archive member is too large");
+    std::fill(out.begin() + offset, out.begin() + offset + width, ' ');
+    std::copy(value.begin(), value.end(), out.begin() + offset);
+  }
+};
+
+// Symbols of each relocatable member of an archive, by member name, in member
+// order
+std::vector<std::pair<std::string, std::vector<Static_symbol>>>
+read_archive_symbols(const std::vector<uint8_t> &content, unsigned jobs) {
+  Archive archive(content);
+  std::vector<const Archive::Member *> relocatable;
+  for (const auto &member : archive.members)
+    if (member.relocatable)
+      relocatable.push_back(&member);
+  std::vector<std::pair<std::string, std::vector<Static_symbol>>> objects;
+  for (const auto *member : relocatable)
+    objects.emplace_back(member->name, std::vector<Static_symbol>());
+  parallel_for(relocatable.size(), jobs, [&](std::size_t i) {
+    try {
+      objects[i].second = read_static_symbols(
+          &content[relocatable[i]->offset], relocatable[i]->size);
+    } catch (const std::exception &e) {
+      throw std::logic_error(relocatable[i]->name + ": " + e.what());
+    }
+  });
+  return objects;
+}
+
+// Renames the global symbols of every relocatable member of an archive and
+// the matching entries of its symbol index, returning whether any name
+// changed.  Members are renamed concurrently, and members that do not change
+// are copied as they are.
+template <typename Rename>
+bool rename_archive_symbols(std::vector<uint8_t> &content, unsigned jobs,
+                            const Rename &rename) {
+  Archive archive(content);
+  const auto &members = archive.members;
+  std::vector<std::optional<std::vector<uint8_t>>> replaced(members.size());
+  parallel_for(members.size(), jobs, [&](std::size_t i) {
+    if (!members[i].relocatable)
+      return;
+    std::vector<uint8_t> member(content.begin() + members[i].offset,
+                                content.begin() + members[i].offset +
+                                    members[i].size);
+    try {
+      if (rename_static_symbols(member, rename))
+        replaced[i] = std::move(member);
+    } catch (const std::exception &e) {
+      throw std::logic_error(members[i].name + ": " + e.what());
+    }
+  });
+
+  bool changed = std::any_of(replaced.begin(), replaced.end(),
+                             [](const auto &member) { return bool(member); });
+  for (const auto &[name, member] : archive.symbols)
+    changed |= members[member].relocatable && rename(name) != name;
+  if (changed)
+    content = archive.write(content, replaced, rename);
+  return changed;
+}
+
+// Renames the global symbols of a relocatable object or of every object in an
+// archive
+template <typename Rename>
+bool rename_static(std::vector<uint8_t> &content, unsigned jobs,
+                   const Rename &rename) {
+  if (is_archive(content))
+    return rename_archive_symbols(content, jobs, rename);
+  return rename_static_symbols(content, rename);
+}
+
+// Whether an object is renamed directly, rather than parsed by LIEF
+bool is_static(const std::vector<uint8_t> &content) {
+  return is_archive(content) || is_relocatable(content);
+}
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_ARCHIVE_H_
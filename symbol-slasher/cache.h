@@ -0,0 +1,145 @@
+/* cache.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_CACHE_H_
+#define SYMBOL_SLASHER_CACHE_H_
+
+#include "digest.h"
+#include "output.h"
+#include <atomic>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <linux/fs.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace slasher {
+
+// Clones a file with a reflink, so both share storage until either is written
+bool reflink(const std::filesystem::path &from,
+             const std::filesystem::path &to) {
+  int in = ::open(from.c_str(), O_RDONLY | O_CLOEXEC);
+  if (in < 0)
+    return false;
+  int out = ::open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  bool cloned = out >= 0 && ::ioctl(out, FICLONE, in) == 0;
+  ::close(in);
+  if (out >= 0)
+    ::close(out);
+  if (!cloned)
+    std::filesystem::remove(to);
+  return cloned;
+}
+
+// Outputs keyed by the input's content and permissions, along with a context
+// describing everything else the output depends on (the store entries and
+// options).  Hits are placed by reflink, or copied where the filesystem
+// cannot clone files, so editing an output in place never changes an entry.
+struct Output_cache {
+  Output_cache(std::filesystem::path dir, std::string context)
+      : dir(dir), context(context) {
+    std::filesystem::create_directories(dir);
+  }
+
+  std::string key(const std::filesystem::path &in_path,
+                  const std::vector<uint8_t> &content) const {
+    Digest digest;
+    digest.update(context);
+    digest.update(content.data(), content.size());
+    digest.update(std::to_string(
+        static_cast<unsigned>(std::filesystem::status(in_path).permissions())));
+    return digest.hex();
+  }
+
+  // Places the cached output for a key, if there is one.  An output that
+  // already matches the entry is not touched, as with any other write.
+  // Where names is given, the names the output looked up are read into it,
+  // and an entry saved without them is a miss.
+  bool fetch(const std::string &key, const std::filesystem::path &out_path,
+             std::vector<std::string> *names = nullptr) {
+    auto cached = dir / key;
+    if (!std::filesystem::exists(cached) ||
+        (names && !read_names(key, *names))) {
+      misses++;
+      return false;
+    }
+    auto permissions = std::filesystem::status(cached).permissions();
+    auto content = read_file(cached);
+    if (!unchanged(out_path, content, mode_t(permissions))) {
+      // The output may be a link to an entry placed by an older version, so
+      // it is removed rather than written through
+      std::filesystem::remove(out_path);
+      if (reflink(cached, out_path))
+        std::filesystem::permissions(out_path, permissions);
+      else
+        write_file(out_path, content, mode_t(permissions));
+    }
+    hits++;
+    return true;
+  }
+
+  // Saves a copy of an output, along with the names it looked up where they
+  // are given.  The copy is renamed into place after the names, so concurrent
+  // runs never see a partial entry.
+  void save(const std::string &key, const std::filesystem::path &out_path,
+            const std::vector<std::string> *names = nullptr) {
+    if (names) {
+      std::string list;
+      for (const auto &name : *names)
+        list += name + "\n";
+      write_file(dir / (key + ".names"),
+                 std::vector<uint8_t>(list.begin(), list.end()));
+    }
+    auto temp = dir / (key + ".tmp" +
+                       std::to_string(std::hash<std::thread::id>()(
+                           std::this_thread::get_id())) +
+                       "." + std::to_string(::getpid()));
+    if (!reflink(out_path, temp))
+      std::filesystem::copy_file(
+          out_path, temp, std::filesystem::copy_options::overwrite_existing);
+    std::filesystem::permissions(
+        temp, std::filesystem::status(out_path).permissions());
+    std::filesystem::rename(temp, dir / key);
+  }
+
+  std::atomic<std::size_t> hits{0};
+  std::atomic<std::size_t> misses{0};
+
+private:
+  bool read_names(const std::string &key, std::vector<std::string> &names) {
+    std::ifstream stream(dir / (key + ".names"));
+    if (!stream)
+      return false;
+    names.clear();
+    for (std::string name; std::getline(stream, name);)
+      names.push_back(name);
+    return true;
+  }
+
+  std::filesystem::path dir;
+  std::string context;
+};
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_CACHE_H_
@@ -0,0 +1,182 @@
+/* closure.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_CLOSURE_H_
+#define SYMBOL_SLASHER_CLOSURE_H_
+
+#include "pool.h"
+#include "store.h"
+#include <LIEF/ELF/DynamicEntryLibrary.hpp>
+#include <LIEF/ELF/DynamicEntryRpath.hpp>
+#include <LIEF/ELF/DynamicEntryRunPath.hpp>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace slasher {
+
+constexpr const char *default_library_dirs[] = {
+    "/lib", "/usr/lib", "/lib64", "/usr/lib64", "/usr/local/lib"};
+
+// The project's objects in the DT_NEEDED closure of an executable.  Libraries
+// are only searched for inside the sysroot, and only those found through a
+// RUNPATH or RPATH, or named in the list of project libraries, belong to the
+// project.  Anything else, such as the C library or libstdc++ of the sysroot,
+// is skipped along with the libraries it needs.
+struct Closure {
+  Closure(std::filesystem::path sysroot,
+          std::set<std::string> project_libraries = {})
+      : sysroot(sysroot), project_libraries(project_libraries) {}
+
+  // Parses the executable and every library it needs, once each
+  void resolve(std::filesystem::path executable, unsigned jobs) {
+    std::vector<std::filesystem::path> frontier{executable};
+    std::set<std::filesystem::path> seen{
+        std::filesystem::weakly_canonical(executable)};
+    while (!frontier.empty()) {
+      std::vector<std::unique_ptr<LIEF::ELF::Binary>> parsed(frontier.size());
+      parallel_for(frontier.size(), jobs, [&](std::size_t i) {
+        parsed[i] = load_binary(frontier[i]);
+      });
+
+      std::vector<std::filesystem::path> next;
+      for (std::size_t i = 0; i < frontier.size(); i++) {
+        for (const auto &library : needed(frontier[i], *parsed[i])) {
+          if (seen.insert(std::filesystem::weakly_canonical(library)).second)
+            next.push_back(library);
+        }
+        paths.push_back(frontier[i]);
+        objects.push_back(std::move(parsed[i]));
+      }
+      frontier = std::move(next);
+    }
+  }
+
+  // Path of an object relative to the sysroot, for mirroring into an output
+  // directory
+  std::filesystem::path relative(std::filesystem::path object_path) const {
+    auto relative = std::filesystem::weakly_canonical(object_path)
+                        .lexically_relative(
+                            std::filesystem::weakly_canonical(sysroot));
+    if (relative.empty() || *relative.begin() == "..")
+      return object_path.filename();
+    return relative;
+  }
+
+  // Paths and parsed objects, with the executable first and each library
+  // after the objects that need it
+  std::vector<std::filesystem::path> paths;
+  std::vector<std::unique_ptr<LIEF::ELF::Binary>> objects;
+
+private:
+  std::vector<std::filesystem::path> needed(std::filesystem::path object_path,
+                                            LIEF::ELF::Binary &object) const {
+    std::vector<std::string> libraries, rpath, runpath;
+    for (auto &entry : object.dynamic_entries()) {
+      switch (entry.tag()) {
+      case LIEF::ELF::DYNAMIC_TAGS::DT_NEEDED:
+        libraries.push_back(
+            dynamic_cast<LIEF::ELF::DynamicEntryLibrary &>(entry).name());
+        break;
+      case LIEF::ELF::DYNAMIC_TAGS::DT_RPATH:
+        split(dynamic_cast<LIEF::ELF::DynamicEntryRpath &>(entry).name(),
+              rpath);
+        break;
+      case LIEF::ELF::DYNAMIC_TAGS::DT_RUNPATH:
+        split(dynamic_cast<LIEF::ELF::DynamicEntryRunPath &>(entry).name(),
+              runpath);
+        break;
+      default:
+        break;
+      }
+    }
+
+    // DT_RPATH is ignored when DT_RUNPATH is present
+    std::vector<std::filesystem::path> dirs;
+    auto origin = object_path.parent_path();
+    for (const auto &dir : runpath.empty() ? rpath : runpath)
+      dirs.push_back(expand(dir, origin));
+
+    std::vector<std::filesystem::path> found;
+    for (const auto &library : libraries) {
+      if (library.find('/') != std::string::npos) {
+        auto path = expand(library, origin);
+        if (std::filesystem::is_regular_file(path))
+          found.push_back(path);
+        continue;
+      }
+      auto path = search(library, dirs);
+      // The default directories hold the system's libraries too
+      if (path.empty() && project_libraries.count(library))
+        path = search(library, default_dirs());
+      if (!path.empty())
+        found.push_back(path);
+    }
+    return found;
+  }
+
+  static std::filesystem::path
+  search(const std::string &library,
+         const std::vector<std::filesystem::path> &dirs) {
+    for (const auto &dir : dirs)
+      if (std::filesystem::is_regular_file(dir / library))
+        return dir / library;
+    return {};
+  }
+
+  std::vector<std::filesystem::path> default_dirs() const {
+    std::vector<std::filesystem::path> dirs;
+    for (const auto &dir : default_library_dirs)
+      dirs.push_back(sysroot / std::filesystem::path(dir).relative_path());
+    return dirs;
+  }
+
+  // Expands $ORIGIN and places absolute paths inside the sysroot
+  std::filesystem::path expand(std::string path,
+                               std::filesystem::path origin) const {
+    for (const auto &token : {"${ORIGIN}", "$ORIGIN"}) {
+      auto pos = path.find(token);
+      if (pos != std::string::npos)
+        return origin /
+               std::filesystem::path(path.substr(pos + std::strlen(token)))
+                   .relative_path();
+    }
+    std::filesystem::path result(path);
+    return result.is_absolute() ? sysroot / result.relative_path() : result;
+  }
+
+  static void split(const std::string &list, std::vector<std::string> &out) {
+    std::istringstream stream(list);
+    for (std::string dir; std::getline(stream, dir, ':');)
+      if (!dir.empty())
+        out.push_back(dir);
+  }
+
+  std::filesystem::path sysroot;
+  // Names of libraries in the default directories that belong to the project
+  std::set<std::string> project_libraries;
+};
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_CLOSURE_H_
@@ -0,0 +1,115 @@
+/* debug.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_DEBUG_H_
+#define SYMBOL_SLASHER_DEBUG_H_
+
+#include "digest.h"
+#include "relocatable.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Debug files in the layout of objcopy --only-keep-debug: the section headers
+// of the object, with the sections a debugger needs kept and every other
+// section marked as having no content, so section indices and addresses still
+// match the stripped object.
+
+namespace slasher {
+
+bool is_debug_section(const std::string &name) {
+  return name.rfind(".debug_", 0) == 0 || name.rfind(".zdebug_", 0) == 0;
+}
+
+template <typename Types>
+std::vector<uint8_t> debug_file(const Symbol_table<Types> &table,
+                                bool debug_sections) {
+  auto header = read_struct<typename Types::Ehdr>(table.data, table.size, 0);
+  std::vector<uint8_t> out(sizeof(header));
+  std::vector<typename Types::Shdr> sections;
+  for (std::size_t i = 0; i < table.sections.size(); i++) {
+    auto section = table.sections[i].second;
+    if (i != 0 && section.sh_type != elf::sht_null &&
+        section.sh_type != elf::sht_nobits) {
+      bool keep = i == table.symtab || i == table.strtab ||
+                  i == table.section_names || section.sh_type == elf::sht_note ||
+                  (debug_sections && is_debug_section(table.section_name(i)));
+      if (keep) {
+        if (section.sh_offset > table.size ||
+            table.size - section.sh_offset < section.sh_size)
+          throw std::logic_error("truncated object file");
+        auto align = std::max<uint64_t>(section.sh_addralign, 1);
+        out.resize((out.size() + align - 1) / align * align);
+        out.insert(out.end(), table.data + section.sh_offset,
+                   table.data + section.sh_offset + section.sh_size);
+        section.sh_offset = out.size() - section.sh_size;
+      } else {
+        section.sh_type = elf::sht_nobits;
+        section.sh_offset = out.size();
+      }
+    }
+    sections.push_back(section);
+  }
+
+  out.resize((out.size() + 7) / 8 * 8);
+  header.e_shoff = out.size();
+  header.e_shentsize = sizeof(typename Types::Shdr);
+  header.e_phoff = 0;
+  header.e_phnum = 0;
+  auto begin = reinterpret_cast<const uint8_t *>(sections.data());
+  out.insert(out.end(), begin, begin + sections.size() * sizeof(sections[0]));
+  std::memcpy(out.data(), &header, sizeof(header));
+  return out;
+}
+
+// Builds the debug file of an object: its symbol table with global names
+// passed through rename, its notes (which carry the build-id that debuggers
+// match on) and, if debug_sections is set, its .debug_* sections
+template <typename Rename>
+std::vector<uint8_t> debug_file(const std::vector<uint8_t> &data,
+                                const Rename &rename, bool debug_sections) {
+  auto content = data;
+  with_symbol_table(data.data(), data.size(), [&](const auto &table) {
+    return table.rename(content, rename);
+  });
+  return with_symbol_table(
+      content.data(), content.size(),
+      [&](const auto &table) { return debug_file(table, debug_sections); });
+}
+
+// The content of a .gnu_debuglink section: the file name of the debug file,
+// padded to four bytes, and its CRC
+std::vector<uint8_t> debuglink(const std::filesystem::path &debug_path,
+                               const std::vector<uint8_t> &debug_content) {
+  auto name = debug_path.filename().string();
+  std::vector<uint8_t> link(name.begin(), name.end());
+  link.resize((link.size() + 4) / 4 * 4);
+  auto crc = crc32(debug_content.data(), debug_content.size());
+  auto bytes = reinterpret_cast<const uint8_t *>(&crc);
+  link.insert(link.end(), bytes, bytes + sizeof(crc));
+  return link;
+}
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_DEBUG_H_
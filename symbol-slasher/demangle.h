@@ -0,0 +1,95 @@
+/* demangle.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_DEMANGLE_H_
+#define SYMBOL_SLASHER_DEMANGLE_H_
+
+#include "pool.h"
+#include <cstdlib>
+#include <cxxabi.h>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace slasher {
+
+// Demangles C++ names, remembering every result, so that a name imported by
+// many objects (such as anything from std::) is only demangled once.  May be
+// used from several threads.
+struct Demangler {
+  std::string operator()(const std::string &name) const {
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex);
+      auto it = names.find(name);
+      if (it != names.end())
+        return it->second.empty() ? name : it->second;
+    }
+    auto result = demangle(name);
+    remember(name, result);
+    return result;
+  }
+
+  // Demangles the names not seen yet on up to jobs threads, ahead of looking
+  // them up
+  void prepare(const std::vector<std::string> &batch, unsigned jobs) const {
+    std::vector<std::string> unseen;
+    {
+      std::shared_lock<std::shared_mutex> lock(mutex);
+      std::unordered_set<std::string> queued;
+      for (const auto &name : batch)
+        if (names.count(name) == 0 && queued.insert(name).second)
+          unseen.push_back(name);
+    }
+    std::vector<std::string> results(unseen.size());
+    parallel_for(unseen.size(), jobs,
+                 [&](std::size_t i) { results[i] = demangle(unseen[i]); });
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    for (std::size_t i = 0; i < unseen.size(); i++)
+      names[unseen[i]] = results[i] == unseen[i] ? "" : results[i];
+  }
+
+  // Remembers a demangled form that is already known, such as one kept in
+  // the store
+  void remember(const std::string &name, const std::string &demangled) const {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    // Names that do not demangle are kept empty, to save memory
+    names[name] = demangled == name ? "" : demangled;
+  }
+
+private:
+  static std::string demangle(const std::string &name) {
+    int status = 0;
+    char *result = abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+    if (status != 0 || !result)
+      return name;
+    std::string demangled_name(result);
+    std::free(result);
+    return demangled_name;
+  }
+
+  mutable std::shared_mutex mutex;
+  mutable std::unordered_map<std::string, std::string> names;
+};
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_DEMANGLE_H_
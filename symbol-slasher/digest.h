@@ -0,0 +1,132 @@
+/* digest.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_DIGEST_H_
+#define SYMBOL_SLASHER_DIGEST_H_
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace slasher {
+
+// A fast 128-bit content digest.  It identifies content for caching and is not
+// meant to resist deliberate collisions.
+struct Digest {
+  void update(const void *data, std::size_t size) {
+    auto bytes = static_cast<const unsigned char *>(data);
+    length += size;
+    for (; size >= 8; bytes += 8, size -= 8) {
+      uint64_t word;
+      std::memcpy(&word, bytes, 8);
+      mix(word);
+    }
+    if (size > 0) {
+      uint64_t word = 0;
+      std::memcpy(&word, bytes, size);
+      mix(word ^ (uint64_t(size) << 56));
+    }
+  }
+
+  void update(const std::string &text) {
+    // The length keeps concatenations of different strings apart
+    uint64_t size = text.size();
+    update(&size, sizeof(size));
+    update(text.data(), text.size());
+  }
+
+  std::pair<uint64_t, uint64_t> value() const {
+    return {finish(high ^ length), finish(low + high)};
+  }
+
+  std::string hex() const {
+    auto [a, b] = value();
+    constexpr auto digits = "0123456789abcdef";
+    std::string out(32, '0');
+    for (int i = 0; i < 16; i++) {
+      out[15 - i] = digits[(a >> (4 * i)) & 0xf];
+      out[31 - i] = digits[(b >> (4 * i)) & 0xf];
+    }
+    return out;
+  }
+
+private:
+  static uint64_t rotate(uint64_t x, int bits) {
+    return (x << bits) | (x >> (64 - bits));
+  }
+
+  static uint64_t finish(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+  }
+
+  void mix(uint64_t word) {
+    high = rotate(high ^ (word * 0x87c37b91114253d5ULL), 31) *
+           0x4cf5ad432745937fULL;
+    low = rotate(low + word, 27) * 0x9e3779b97f4a7c15ULL + high;
+  }
+
+  uint64_t high = 0x6a09e667f3bcc908ULL;
+  uint64_t low = 0xbb67ae8584caa73bULL;
+  uint64_t length = 0;
+};
+
+// The CRC-32 that .gnu_debuglink uses to check a debug file
+uint32_t crc32(const uint8_t *data, std::size_t size) {
+  static const auto table = [] {
+    std::vector<uint32_t> entries(256);
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t entry = i;
+      for (int bit = 0; bit < 8; bit++)
+        entry = entry & 1 ? 0xedb88320 ^ (entry >> 1) : entry >> 1;
+      entries[i] = entry;
+    }
+    return entries;
+  }();
+  uint32_t crc = 0xffffffff;
+  for (std::size_t i = 0; i < size; i++)
+    crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+  return crc ^ 0xffffffff;
+}
+
+std::string digest_file(const std::filesystem::path &path) {
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream.is_open())
+    throw std::logic_error("Could not open " + path.string() + " for reading");
+  Digest digest;
+  std::vector<char> buffer(1 << 20);
+  while (stream) {
+    stream.read(buffer.data(), buffer.size());
+    digest.update(buffer.data(), stream.gcount());
+  }
+  return digest.hex();
+}
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_DIGEST_H_
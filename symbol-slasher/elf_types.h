@@ -0,0 +1,189 @@
+/* elf_types.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_ELF_TYPES_H_
+#define SYMBOL_SLASHER_ELF_TYPES_H_
+
+#include <cstdint>
+
+// The few ELF structures read directly rather than through LIEF.  These are
+// declared here instead of taken from <elf.h>, whose macros clash with the
+// names of LIEF's enumerators.
+
+namespace slasher::elf {
+
+constexpr unsigned char magic[] = {0x7f, 'E', 'L', 'F'};
+constexpr int ident_size = 16;
+constexpr int class_offset = 4;
+constexpr int data_offset = 5;
+constexpr unsigned char class32 = 1;
+constexpr unsigned char class64 = 2;
+constexpr unsigned char data_lsb = 1;
+constexpr unsigned char data_msb = 2;
+constexpr unsigned char host_data =
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__ ? data_lsb : data_msb;
+
+constexpr uint16_t et_rel = 1;
+constexpr uint32_t pt_load = 1;
+constexpr uint32_t pt_note = 4;
+constexpr uint32_t nt_gnu_build_id = 3;
+constexpr uint32_t sht_null = 0;
+constexpr uint32_t sht_symtab = 2;
+constexpr uint32_t sht_note = 7;
+constexpr uint32_t sht_nobits = 8;
+constexpr uint16_t shn_undef = 0;
+constexpr uint16_t shn_xindex = 0xffff;
+constexpr unsigned char stb_local = 0;
+constexpr unsigned char stb_global = 1;
+constexpr unsigned char stb_weak = 2;
+
+// The relocation that copies a shared object's data into an executable, for
+// each machine that has one, or zero
+constexpr uint32_t copy_relocation(uint16_t machine) {
+  switch (machine) {
+  case 3:   // EM_386
+  case 62:  // EM_X86_64
+    return 5;
+  case 40:  // EM_ARM
+    return 20;
+  case 183: // EM_AARCH64
+    return 1024;
+  case 20:  // EM_PPC
+  case 21:  // EM_PPC64
+    return 19;
+  case 243: // EM_RISCV
+    return 4;
+  default:
+    return 0;
+  }
+}
+
+struct Nhdr {
+  uint32_t n_namesz;
+  uint32_t n_descsz;
+  uint32_t n_type;
+};
+
+struct Types32 {
+  struct Ehdr {
+    unsigned char e_ident[ident_size];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint32_t e_entry;
+    uint32_t e_phoff;
+    uint32_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+  };
+
+  struct Phdr {
+    uint32_t p_type;
+    uint32_t p_offset;
+    uint32_t p_vaddr;
+    uint32_t p_paddr;
+    uint32_t p_filesz;
+    uint32_t p_memsz;
+    uint32_t p_flags;
+    uint32_t p_align;
+  };
+
+  struct Shdr {
+    uint32_t sh_name;
+    uint32_t sh_type;
+    uint32_t sh_flags;
+    uint32_t sh_addr;
+    uint32_t sh_offset;
+    uint32_t sh_size;
+    uint32_t sh_link;
+    uint32_t sh_info;
+    uint32_t sh_addralign;
+    uint32_t sh_entsize;
+  };
+
+  struct Sym {
+    uint32_t st_name;
+    uint32_t st_value;
+    uint32_t st_size;
+    unsigned char st_info;
+    unsigned char st_other;
+    uint16_t st_shndx;
+  };
+};
+
+struct Types64 {
+  struct Ehdr {
+    unsigned char e_ident[ident_size];
+    uint16_t e_type;
+    uint16_t e_machine;
+    uint32_t e_version;
+    uint64_t e_entry;
+    uint64_t e_phoff;
+    uint64_t e_shoff;
+    uint32_t e_flags;
+    uint16_t e_ehsize;
+    uint16_t e_phentsize;
+    uint16_t e_phnum;
+    uint16_t e_shentsize;
+    uint16_t e_shnum;
+    uint16_t e_shstrndx;
+  };
+
+  struct Phdr {
+    uint32_t p_type;
+    uint32_t p_flags;
+    uint64_t p_offset;
+    uint64_t p_vaddr;
+    uint64_t p_paddr;
+    uint64_t p_filesz;
+    uint64_t p_memsz;
+    uint64_t p_align;
+  };
+
+  struct Shdr {
+    uint32_t sh_name;
+    uint32_t sh_type;
+    uint64_t sh_flags;
+    uint64_t sh_addr;
+    uint64_t sh_offset;
+    uint64_t sh_size;
+    uint32_t sh_link;
+    uint32_t sh_info;
+    uint64_t sh_addralign;
+    uint64_t sh_entsize;
+  };
+
+  struct Sym {
+    uint32_t st_name;
+    unsigned char st_info;
+    unsigned char st_other;
+    uint16_t st_shndx;
+    uint64_t st_value;
+    uint64_t st_size;
+  };
+};
+
+} // namespace slasher::elf
+
+#endif // SYMBOL_SLASHER_ELF_TYPES_H_
@@ -0,0 +1,505 @@
+/* io.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_IO_H_
+#define SYMBOL_SLASHER_IO_H_
+
+#include "pool.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <linux/io_uring.h>
+#include <mutex>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace slasher {
+
+// Time spent and bytes moved in each stage of a run
+struct Io_stats {
+  struct Stage {
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> nanoseconds{0};
+  };
+
+  void report(std::ostream &stream) const {
+    auto line = [&](const char *name, const Stage &stage) {
+      double seconds = stage.nanoseconds / 1e9;
+      double mib = stage.bytes / double(1 << 20);
+      stream << name << stage.count << " objects, " << mib << " MiB in "
+             << seconds << " s";
+      if (seconds > 0)
+        stream << " (" << mib / seconds << " MiB/s)";
+      stream << std::endl;
+    };
+    stream << "read engine: " << engine << std::endl;
+    line("read:    ", read);
+    line("process: ", process);
+    line("write:   ", write);
+  }
+
+  // Read time is the wall time of the reader, while the others are summed over
+  // threads.  Processing includes writing.
+  Stage read, process, write;
+  const char *engine = "none";
+};
+
+Io_stats &io_stats() {
+  static Io_stats stats;
+  return stats;
+}
+
+// Limit on the content read ahead of its consumers
+std::size_t &max_in_flight() {
+  static std::size_t bytes = std::size_t(256) << 20;
+  return bytes;
+}
+
+// Measures the time until it goes out of scope
+struct Stage_timer {
+  Stage_timer(Io_stats::Stage &stage, uint64_t bytes = 0) : stage(stage) {
+    stage.count++;
+    stage.bytes += bytes;
+  }
+  ~Stage_timer() {
+    stage.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                             std::chrono::steady_clock::now() - start)
+                             .count();
+  }
+
+  Io_stats::Stage &stage;
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+};
+
+// A minimal io_uring, set up with raw system calls
+struct Ring {
+  Ring(unsigned entries) {
+    io_uring_params params;
+    std::memset(&params, 0, sizeof(params));
+    fd = ::syscall(__NR_io_uring_setup, entries, &params);
+    if (fd < 0)
+      return;
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+      sq_size = cq_size = std::max(sq_size, cq_size);
+    sq = map(sq_size, IORING_OFF_SQ_RING);
+    cq = params.features & IORING_FEAT_SINGLE_MMAP
+             ? sq
+             : map(cq_size, IORING_OFF_CQ_RING);
+    sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = static_cast<io_uring_sqe *>(map(sqes_size, IORING_OFF_SQES));
+    if (!sq || !cq || !sqes) {
+      ::close(fd);
+      fd = -1;
+      return;
+    }
+    sq_tail = field(sq, params.sq_off.tail);
+    sq_mask = *field(sq, params.sq_off.ring_mask);
+    sq_array = field(sq, params.sq_off.array);
+    cq_head = field(cq, params.cq_off.head);
+    cq_tail = field(cq, params.cq_off.tail);
+    cq_mask = *field(cq, params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(static_cast<char *>(cq) +
+                                            params.cq_off.cqes);
+    capacity = params.sq_entries;
+  }
+
+  Ring(const Ring &) = delete;
+
+  ~Ring() {
+    if (sqes)
+      ::munmap(sqes, sqes_size);
+    if (cq && cq != sq)
+      ::munmap(cq, cq_size);
+    if (sq)
+      ::munmap(sq, sq_size);
+    if (fd >= 0)
+      ::close(fd);
+  }
+
+  bool ok() const { return fd >= 0; }
+
+  // Submits a read into the buffer described by vec, which must stay valid
+  // until the read completes
+  void read(int file, const iovec *vec, uint64_t offset, uint64_t user_data) {
+    auto tail = *sq_tail;
+    auto index = tail & sq_mask;
+    auto &sqe = sqes[index];
+    std::memset(&sqe, 0, sizeof(sqe));
+    sqe.opcode = IORING_OP_READV;
+    sqe.fd = file;
+    sqe.addr = reinterpret_cast<uint64_t>(vec);
+    sqe.len = 1;
+    sqe.off = offset;
+    sqe.user_data = user_data;
+    sq_array[index] = index;
+    __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if (::syscall(__NR_io_uring_enter, fd, 1, 0, 0, nullptr, 0) < 0)
+      throw std::logic_error("io_uring submission failed");
+  }
+
+  // Waits for a completion, returning its user data and result
+  std::pair<uint64_t, int32_t> wait() {
+    for (;;) {
+      auto head = *cq_head;
+      if (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+        auto &cqe = cqes[head & cq_mask];
+        std::pair<uint64_t, int32_t> result(cqe.user_data, cqe.res);
+        __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+        return result;
+      }
+      if (::syscall(__NR_io_uring_enter, fd, 0, 1, IORING_ENTER_GETEVENTS,
+                    nullptr, 0) < 0 &&
+          errno != EINTR)
+        throw std::logic_error("io_uring wait failed");
+    }
+  }
+
+  unsigned capacity = 0;
+
+private:
+  void *map(std::size_t size, uint64_t offset) {
+    auto address = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, offset);
+    return address == MAP_FAILED ? nullptr : address;
+  }
+
+  static uint32_t *field(void *ring, uint32_t offset) {
+    return reinterpret_cast<uint32_t *>(static_cast<char *>(ring) + offset);
+  }
+
+  int fd = -1;
+  void *sq = nullptr, *cq = nullptr;
+  std::size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+  io_uring_sqe *sqes = nullptr;
+  io_uring_cqe *cqes = nullptr;
+  uint32_t *sq_tail = nullptr, *sq_array = nullptr;
+  uint32_t *cq_head = nullptr, *cq_tail = nullptr;
+  uint32_t sq_mask = 0, cq_mask = 0;
+};
+
+// Whether a path names standard input or output rather than a file
+bool is_stdio(const std::filesystem::path &path) { return path == "-"; }
+
+// Reads a whole file, where a single object is handled on its own, or all of
+// standard input
+std::vector<uint8_t> read_file(const std::filesystem::path &path) {
+  if (is_stdio(path)) {
+    std::vector<uint8_t> data(1 << 20);
+    for (std::size_t size = 0;;) {
+      if (size == data.size())
+        data.resize(size * 2);
+      auto read = ::read(STDIN_FILENO, data.data() + size, data.size() - size);
+      if (read < 0 && errno == EINTR)
+        continue;
+      if (read < 0)
+        throw std::logic_error("Could not read standard input");
+      if (read == 0) {
+        data.resize(size);
+        return data;
+      }
+      size += read;
+    }
+  }
+  std::ifstream stream(path, std::ios::binary);
+  if (!stream)
+    throw std::logic_error("Could not open object file for reading");
+  return std::vector<uint8_t>(std::istreambuf_iterator<char>(stream), {});
+}
+
+// Reads whole files ahead of their consumers, in order, with at most depth
+// reads in flight and at most max_bytes of content waiting to be taken (a
+// single larger file is still read on its own).  Reads go through io_uring,
+// or through a few reader threads where io_uring is unavailable.
+struct Prefetcher {
+  Prefetcher(const std::vector<std::filesystem::path> &paths,
+             std::size_t max_bytes, unsigned depth = 16)
+      : paths(paths), slots(paths.size()), max_bytes(max_bytes),
+        depth(std::max(1u, depth)) {
+    readers.emplace_back([this]() {
+      auto start = std::chrono::steady_clock::now();
+      Ring ring(this->depth);
+      io_stats().engine = "io_uring";
+      if (!ring.ok() || !read_ring(ring)) {
+        io_stats().engine = "threads";
+        std::vector<std::thread> threads;
+        for (unsigned i = 0; i < this->depth; i++)
+          threads.emplace_back([this]() { read_blocking(); });
+        for (auto &thread : threads)
+          thread.join();
+      }
+      io_stats().read.nanoseconds +=
+          std::chrono::duration_cast<std::chrono::nanoseconds>(
+              std::chrono::steady_clock::now() - start)
+              .count();
+    });
+  }
+
+  Prefetcher(const Prefetcher &) = delete;
+
+  ~Prefetcher() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    budget_changed.notify_all();
+    for (auto &thread : readers)
+      thread.join();
+    for (auto &slot : slots)
+      if (slot.fd >= 0)
+        ::close(slot.fd);
+  }
+
+  // Waits for a file to be read and hands over its content
+  std::vector<uint8_t> take(std::size_t i) {
+    std::unique_lock<std::mutex> lock(mutex);
+    slot_ready.wait(lock, [&]() { return slots[i].ready; });
+    if (!slots[i].error.empty())
+      throw std::logic_error(slots[i].error);
+    in_flight -= slots[i].data.size();
+    budget_changed.notify_all();
+    return std::move(slots[i].data);
+  }
+
+private:
+  struct Slot {
+    std::vector<uint8_t> data;
+    std::string error;
+    bool ready = false;
+    int fd = -1;
+    std::size_t done = 0;
+    iovec vec;
+  };
+
+  // Claims and opens the next file, returning false once there are none left.
+  // A file that fails to open is still claimed, and fails when reserved.
+  bool claim(std::size_t &i) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (stopping || next >= paths.size())
+      return false;
+    i = next++;
+    auto &slot = slots[i];
+    struct stat info;
+    slot.fd = ::open(paths[i].c_str(), O_RDONLY | O_CLOEXEC);
+    if (slot.fd >= 0 && ::fstat(slot.fd, &info) == 0 && S_ISREG(info.st_mode))
+      slot.data.resize(info.st_size);
+    else
+      slot.error = "Could not open object file for reading";
+    return true;
+  }
+
+  enum class Reservation { read, skip, later };
+
+  // Reserves memory for a claimed file.  Reservations are made in the order
+  // files were claimed, so the file consumers wait for next is never starved
+  // by files after it.  Waits only if allowed to, so that the ring can reap
+  // its own reads instead.  Files that failed to open or are empty finish
+  // here and are skipped, as is everything once stopping.
+  Reservation reserve(std::size_t i, bool wait) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto &slot = slots[i];
+    auto fits = [&]() {
+      return stopping ||
+             (reserved == i && (in_flight == 0 || in_flight + slot.data.size() <=
+                                                      max_bytes));
+    };
+    if (!fits()) {
+      if (!wait)
+        return Reservation::later;
+      budget_changed.wait(lock, fits);
+    }
+    if (stopping)
+      return Reservation::skip;
+    in_flight += slot.data.size();
+    reserved++;
+    budget_changed.notify_all();
+    if (!slot.error.empty() || slot.data.empty()) {
+      finish(i, slot.error);
+      return Reservation::skip;
+    }
+    return Reservation::read;
+  }
+
+  // Marks a slot as read, with an error message if it failed.  Called with
+  // the mutex held.
+  void finish(std::size_t i, std::string error = "") {
+    auto &slot = slots[i];
+    if (slot.fd >= 0)
+      ::close(slot.fd);
+    slot.fd = -1;
+    if (!error.empty()) {
+      in_flight -= std::min(in_flight, slot.data.size());
+      slot.data.clear();
+      slot.error = error;
+    } else {
+      io_stats().read.count++;
+      io_stats().read.bytes += slot.data.size();
+    }
+    slot.ready = true;
+    slot_ready.notify_all();
+  }
+
+  void submit(Ring &ring, std::size_t i) {
+    auto &slot = slots[i];
+    slot.vec.iov_base = slot.data.data() + slot.done;
+    slot.vec.iov_len =
+        std::min<std::size_t>(slot.data.size() - slot.done, 1 << 30);
+    ring.read(slot.fd, &slot.vec, slot.done, i);
+  }
+
+  // Reads every file through the ring.  Returns false if the ring fails, once
+  // the files it was reading have been finished with blocking reads.
+  bool read_ring(Ring &ring) {
+    std::vector<std::size_t> active;
+    bool claimed = false;
+    std::size_t i;
+    try {
+      for (;;) {
+        while (active.size() < ring.capacity) {
+          if (!claimed && !(claimed = claim(i)))
+            break;
+          auto reservation = reserve(i, active.empty());
+          if (reservation == Reservation::later)
+            break;
+          claimed = false;
+          if (reservation == Reservation::read) {
+            active.push_back(i);
+            submit(ring, i);
+          }
+        }
+        if (active.empty())
+          return true;
+
+        auto [completed, result] = ring.wait();
+        auto &slot = slots[completed];
+        if (result > 0 && slot.done + result < slot.data.size()) {
+          slot.done += result;
+          submit(ring, completed);
+          continue;
+        }
+        active.erase(std::find(active.begin(), active.end(), completed));
+        std::lock_guard<std::mutex> lock(mutex);
+        finish(completed, result > 0 ? "" : "Could not read object file");
+      }
+    } catch (const std::exception &) {
+      // Reads are only counted done once reaped, so they can be redone
+      for (auto slot : active)
+        read_slot(slot);
+      if (claimed && reserve(i, true) == Reservation::read)
+        read_slot(i);
+      return false;
+    }
+  }
+
+  void read_blocking() {
+    std::size_t i;
+    while (claim(i))
+      if (reserve(i, true) == Reservation::read)
+        read_slot(i);
+  }
+
+  // Reads the rest of a reserved file with pread
+  void read_slot(std::size_t i) {
+    auto &slot = slots[i];
+    std::string error;
+    while (slot.done < slot.data.size()) {
+      auto result = ::pread(slot.fd, slot.data.data() + slot.done,
+                            slot.data.size() - slot.done, slot.done);
+      if (result < 0 && errno == EINTR)
+        continue;
+      if (result <= 0) {
+        error = "Could not read object file";
+        break;
+      }
+      slot.done += result;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    finish(i, error);
+  }
+
+  const std::vector<std::filesystem::path> &paths;
+  std::vector<Slot> slots;
+  std::size_t max_bytes;
+  unsigned depth;
+
+  std::mutex mutex;
+  std::condition_variable slot_ready, budget_changed;
+  std::size_t next = 0, reserved = 0, in_flight = 0;
+  bool stopping = false;
+  std::vector<std::thread> readers;
+};
+
+// Processes files in order on up to jobs threads while the prefetcher reads
+// the files that come next, so reading, processing and writing overlap.  A
+// file that cannot be read is passed to on_error, with a message, instead of
+// func.
+template <typename Func, typename Error>
+void pipeline(const std::vector<std::filesystem::path> &paths, unsigned jobs,
+              Func func, Error on_error) {
+  // Standard input cannot be read ahead, and is only ever a single object
+  if (paths.size() == 1 && is_stdio(paths[0])) {
+    auto data = read_file(paths[0]);
+    Stage_timer timer(io_stats().process, data.size());
+    func(0, data);
+    return;
+  }
+  Prefetcher prefetcher(paths, max_in_flight());
+  parallel_for_in_order(paths.size(), jobs, [&](std::size_t i) {
+    std::vector<uint8_t> data;
+    try {
+      data = prefetcher.take(i);
+    } catch (const std::exception &e) {
+      on_error(i, std::string(e.what()));
+      return;
+    }
+    Stage_timer timer(io_stats().process, data.size());
+    func(i, data);
+  });
+}
+
+// As above, failing on the first file that cannot be read
+template <typename Func>
+void pipeline(const std::vector<std::filesystem::path> &paths, unsigned jobs,
+              Func func) {
+  pipeline(paths, jobs, func, [&](std::size_t i, const std::string &error) {
+    throw std::logic_error(paths[i].string() + ": " + error);
+  });
+}
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_IO_H_
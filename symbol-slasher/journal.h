@@ -0,0 +1,120 @@
+/* journal.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_JOURNAL_H_
+#define SYMBOL_SLASHER_JOURNAL_H_
+
+#include "digest.h"
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <nlohmann/json.hpp>
+#include <string>
+#include <vector>
+
+using json = nlohmann::json;
+
+namespace slasher {
+
+// A compact set of symbol names.  It may report names that were never added,
+// which only costs an unnecessary rehash, but never misses one that was.
+struct Bloom {
+  Bloom(std::size_t count) : bits(std::max<std::size_t>(8, count * 10 / 8)) {}
+
+  Bloom(const std::string &hex) : bits(hex.size() / 2) {
+    for (std::size_t i = 0; i < bits.size(); i++)
+      bits[i] = std::stoi(hex.substr(2 * i, 2), nullptr, 16);
+  }
+
+  void add(const std::string &name) {
+    auto [a, b] = probes(name);
+    for (int i = 0; i < hashes; i++, a += b)
+      bits[(a % (bits.size() * 8)) / 8] |= 1 << (a % 8);
+  }
+
+  bool contains(const std::string &name) const {
+    if (bits.empty())
+      return false;
+    auto [a, b] = probes(name);
+    for (int i = 0; i < hashes; i++, a += b)
+      if (!(bits[(a % (bits.size() * 8)) / 8] & (1 << (a % 8))))
+        return false;
+    return true;
+  }
+
+  std::string hex() const {
+    constexpr auto digits = "0123456789abcdef";
+    std::string out;
+    for (auto byte : bits) {
+      out += digits[byte >> 4];
+      out += digits[byte & 0xf];
+    }
+    return out;
+  }
+
+private:
+  static constexpr int hashes = 7;
+
+  static std::pair<uint64_t, uint64_t> probes(const std::string &name) {
+    Digest digest;
+    digest.update(name);
+    auto [a, b] = digest.value();
+    return {a, b | 1};
+  }
+
+  std::vector<uint8_t> bits;
+};
+
+// Records, for each hashed output, how it was made and which names it looked
+// up in the store, so that it can be rewritten when any of them change
+struct Journal {
+  Journal(std::filesystem::path journal_path) : journal_path(journal_path) {
+    std::ifstream journal_stream(journal_path);
+    if (journal_stream.is_open() &&
+        journal_stream.peek() != std::ifstream::traits_type::eof())
+      journal_stream >> outputs;
+    if (!outputs.is_object())
+      outputs = json::object();
+  }
+
+  ~Journal() { flush(); }
+
+  void flush() {
+    std::lock_guard<std::mutex> lock(mutex);
+    std::ofstream journal_stream(journal_path);
+    journal_stream << outputs.dump(2) << std::endl;
+  }
+
+  void record(const std::filesystem::path &out_path, json entry) {
+    std::lock_guard<std::mutex> lock(mutex);
+    outputs[out_path.string()] = entry;
+  }
+
+  json outputs;
+
+private:
+  std::filesystem::path journal_path;
+  std::mutex mutex;
+};
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_JOURNAL_H_
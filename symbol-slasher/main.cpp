@@ -17,11 +17,29 @@ You should have received a copy of the GNU General Public License
 along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
 */
 
+#include "cache.h"
+#include "closure.h"
 #include "cxxopts.hpp"
+#include "journal.h"
+#include "search.h"
 #include "store.h"
+#include "symbolize.h"
+#include "text.h"
+#include "tree.h"
+#include "watch.h"
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <chrono>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <map>
+#include <optional>
+#include <set>
 #include <string>
+#include <tuple>
 
 constexpr auto insert_desc =
     "Parses objects and appends their hashed symbol names to the symbol store.";
@@ -31,15 +49,43 @@ constexpr auto dehash_desc = "Replaces hashed symbol names in an object with "
                              "the original name from the symbol store.";
 constexpr auto list_desc =
     "Lists the hashed and dehashed symbol names in an object.";
+constexpr auto rehash_desc = "Hashes recorded outputs again if symbols they use "
+                             "were inserted or renamed since.";
+constexpr auto renumber_desc =
+    "Reassigns hashes so the symbols most referenced by objects are shortest.";
+constexpr auto watch_desc = "Inserts and hashes objects as they are written "
+                            "into watched directories.";
+constexpr auto search_desc = "Finds stored symbols whose name contains text or "
+                             "matches a regular expression.";
+constexpr auto dehash_text_desc = "Replaces hashed names in text, such as logs and "
+                                  "stack traces, with the original names.";
+constexpr auto symbolize_desc = "Names the symbols at offsets into hashed modules, "
+                                "identified by build-id.";
+constexpr auto pipeline_desc = "Inserts and hashes the objects of a manifest "
+                               "in one run against the same store.";
 
 int insert(int argc, char **argv) {
   std::string store_path;
+  std::string partition;
+  std::string partition_prefix;
+  unsigned jobs;
+  std::size_t in_flight;
   std::vector<std::string> object_paths;
   cxxopts::Options options("symbol-slasher insert", insert_desc);
   // clang-format off
   options.add_options()
       ("h,help", "print this help")
       ("s,symbols", "path to the store of symbol hashes", cxxopts::value(store_path)->default_value("symbols.json"))
+      ("p,partition", "partition of the store to insert into", cxxopts::value(partition))
+      ("prefix", "prefix of hashed names when creating a partition", cxxopts::value(partition_prefix))
+      ("l,link-set", "only insert symbols defined in one object and imported by another")
+      ("trust-build-id", "skip objects whose build-id was already inserted without reading them")
+      ("stamps", "keep stamp files next to the store, for hash --depfile")
+      ("demangled", "keep the demangled form of each symbol in the store, for list --demangle")
+      ("tar", "read the objects in tar streams (- for standard input)")
+      ("j,jobs", "number of objects to parse concurrently", cxxopts::value(jobs)->default_value(std::to_string(slasher::default_jobs())))
+      ("in-flight", "MiB of input to read ahead of processing", cxxopts::value(in_flight)->default_value("256"))
+      ("stats", "report the throughput of reading, processing and writing")
       ("object_paths", "paths of objects to read", cxxopts::value(object_paths))
       ;
   // clang-format on
@@ -51,73 +97,359 @@ int insert(int argc, char **argv) {
     std::cout << options.help() << std::endl;
     return 0;
   }
+  slasher::max_in_flight() = in_flight << 20;
 
   slasher::Inserter inserter;
   inserter.open(store_path);
-  for (const auto &object_path : object_paths)
-    inserter(object_path);
+  inserter.select(partition, partition_prefix);
+  if (args.count("stamps"))
+    inserter.keep_stamps();
+  if (args.count("demangled"))
+    inserter.keep_demangled();
+  if (args.count("tar")) {
+    if (args.count("link-set") || args.count("trust-build-id"))
+      throw std::logic_error(
+          "--tar cannot be combined with --link-set or --trust-build-id");
+    int result = 0;
+    for (const auto &tar_path : object_paths)
+      result |= inserter.tar(tar_path, jobs);
+    if (args.count("stats"))
+      slasher::io_stats().report(std::cerr);
+    return result;
+  }
+  object_paths = slasher::expand_objects(object_paths, jobs);
+  if (args.count("link-set")) {
+    inserter.link_set({object_paths.begin(), object_paths.end()}, jobs);
+  } else {
+    inserter({object_paths.begin(), object_paths.end()}, jobs,
+             args.count("trust-build-id"));
+  }
+  if (args.count("stats"))
+    slasher::io_stats().report(std::cerr);
   return 0;
 }
 
+using Object_pair = std::pair<std::string, std::string>;
+
+// Collects the objects to process, given either as a single input and output
+// path, where "-" stands for standard input or output, or as input:output
+// pairs on the command line or in a list file
+std::vector<Object_pair> object_pairs(const std::vector<std::string> &objects,
+                                      const std::string &list_path) {
+  if (objects.size() == 2 &&
+      std::none_of(objects.begin(), objects.end(), [](const auto &object) {
+        return object.find(':') != std::string::npos;
+      })) {
+    return {{objects[0], objects[1]}};
+  }
+  auto specs = objects;
+  if (!list_path.empty()) {
+    std::ifstream list_stream(list_path);
+    if (!list_stream.is_open())
+      throw std::logic_error("failed to open object list");
+    for (std::string line; std::getline(list_stream, line);)
+      if (!line.empty())
+        specs.push_back(line);
+  }
+
+  std::vector<Object_pair> pairs;
+  for (const auto &spec : specs) {
+    auto separator = spec.find(':');
+    if (separator == std::string::npos)
+      throw std::logic_error("expected input:output, got " + spec);
+    pairs.emplace_back(spec.substr(0, separator), spec.substr(separator + 1));
+    if (slasher::is_stdio(pairs.back().first) ||
+        slasher::is_stdio(pairs.back().second))
+      throw std::logic_error("- is only accepted for a single object");
+  }
+  return pairs;
+}
+
+// Processes every pair concurrently, mirroring directories into output
+// directories.  Inputs are read ahead while earlier ones are processed, and
+// func receives each input's content.  Errors are reported per object and do
+// not stop the others; returns nonzero if any object failed.
+template <typename Func>
+int for_each_pair(const std::vector<Object_pair> &objects, unsigned jobs,
+                  const Func &func) {
+  slasher::Mirror mirror;
+  for (const auto &[in_path, out_path] : objects)
+    mirror.add(in_path, out_path, jobs);
+  const auto &pairs = mirror.objects;
+  std::vector<std::filesystem::path> in_paths;
+  for (const auto &pair : pairs)
+    in_paths.push_back(pair.first);
+
+  std::atomic<std::size_t> failed(0);
+  auto report = [&](std::size_t i, const std::string &error) {
+    std::cerr << "Error: " + pairs[i].first + ": " + error + "\n";
+    failed++;
+  };
+  slasher::pipeline(
+      in_paths, jobs,
+      [&](std::size_t i, const auto &data) {
+        try {
+          func(pairs[i].first, pairs[i].second, data);
+        } catch (const std::exception &e) {
+          report(i, e.what());
+        }
+      },
+      report);
+  mirror.link();
+  return failed == 0 ? 0 : 1;
+}
+
+// Inserts the symbols defined by the libraries in the closure of an
+// executable, then hashes the executable and its libraries into out_dir
+void hash_closure(slasher::Hasher &hasher, std::string closure_path,
+                  std::string sysroot,
+                  const std::vector<std::string> &libraries,
+                  std::filesystem::path out_dir, unsigned jobs) {
+  slasher::Closure closure(sysroot, {libraries.begin(), libraries.end()});
+  closure.resolve(closure_path, jobs);
+  for (std::size_t i = 1; i < closure.objects.size(); i++)
+    hasher.insert(*closure.objects[i]);
+  slasher::parallel_for(closure.paths.size(), jobs, [&](std::size_t i) {
+    auto out_path = out_dir / closure.relative(closure.paths[i]);
+    std::filesystem::create_directories(out_path.parent_path());
+    hasher(closure.paths[i], out_path, closure.objects[i]);
+  });
+}
+
 int hash(int argc, char **argv) {
   std::string store_path;
+  std::string partition;
+  std::vector<std::string> link_set;
+  unsigned jobs;
+  std::size_t in_flight;
+  std::string closure_path;
+  std::string sysroot;
+  std::vector<std::string> libraries;
+  std::string out_dir;
+  std::string list_path;
+  std::string cache_dir;
+  std::string journal_path;
+  std::string depfile_path;
+  std::string debug_out;
   std::string input_object_path;
   std::string output_object_path;
+  std::vector<std::string> objects;
   cxxopts::Options options("symbol-slasher hash", hash_desc);
   // clang-format off
   options.add_options()
       ("h,help", "print this help")
       ("s,symbols", "path to the store of symbol hashes", cxxopts::value(store_path)->default_value("symbols.json"))
+      ("p,partition", "partition of the store to hash from", cxxopts::value(partition))
       ("k,keep-static", "do not discard static symbols")
+      ("l,link-set", "hide exports not imported by any of these objects", cxxopts::value(link_set))
+      ("j,jobs", "number of objects to process concurrently", cxxopts::value(jobs)->default_value(std::to_string(slasher::default_jobs())))
+      ("in-flight", "MiB of input to read ahead of processing", cxxopts::value(in_flight)->default_value("256"))
+      ("stats", "report the throughput of reading, processing and writing")
+      ("closure", "insert and hash an executable and all of its libraries", cxxopts::value(closure_path))
+      ("sysroot", "directory to search for the libraries of the closure", cxxopts::value(sysroot))
+      ("library", "project library to take from the sysroot's default directories", cxxopts::value(libraries))
+      ("out", "directory to write the hashed closure to", cxxopts::value(out_dir))
+      ("from-list", "file listing an input:output pair per line", cxxopts::value(list_path))
+      ("cache", "directory of previously hashed outputs to reuse", cxxopts::value(cache_dir))
+      ("r,record", "journal to record hashed outputs in, for rehash", cxxopts::value(journal_path))
+      ("depfile", "ninja depfile to write, listing the store stamps each output depends on", cxxopts::value(depfile_path))
+      ("debug-out", "debug file to move static symbols to, or a directory of them when hashing several objects", cxxopts::value(debug_out))
+      ("split-debug", "also move .debug_* sections to the debug file")
+      ("tar", "input and output are tar streams, whose objects are hashed and other files copied")
       ("i,input-object-path", "object to read", cxxopts::value(input_object_path))
       ("o,output-object-path", "new object to create", cxxopts::value(output_object_path))
+      ("objects", "input and output object, or input:output pairs", cxxopts::value(objects))
       ;
   // clang-format on
-  options.parse_positional({"input-object-path", "output-object-path"});
-  options.positional_help("input-object-path output-object-path");
+  options.parse_positional({"objects"});
+  options.positional_help("input-object-path output-object-path | input:output...");
   auto args = options.parse(argc, argv);
 
   if (args.count("help")) {
     std::cout << options.help() << std::endl;
     return 0;
   }
+  slasher::max_in_flight() = in_flight << 20;
+
+  std::unique_ptr<slasher::Journal> journal;
+  if (!journal_path.empty())
+    journal = std::make_unique<slasher::Journal>(journal_path);
+  std::unique_ptr<slasher::Depfile> depfile;
+  if (!depfile_path.empty())
+    depfile = std::make_unique<slasher::Depfile>(depfile_path, store_path);
+  auto depend = [&](slasher::Hasher &hasher) {
+    if (!depfile)
+      return;
+    if (!hasher.keeps_stamps())
+      throw std::logic_error(
+          "--depfile needs a store with stamps; insert with --stamps first");
+    hasher.depend(*depfile);
+  };
+  if (!debug_out.empty() && !cache_dir.empty())
+    throw std::logic_error("--debug-out cannot be combined with --cache");
+  // Several outputs get debug files under the directory, at their own path
+  auto debug_dir = [&](const std::filesystem::path &out_path) {
+    auto debug = std::filesystem::path(debug_out) / out_path.relative_path();
+    return debug.concat(".debug");
+  };
+
+  if (args.count("closure")) {
+    if (!args.count("out"))
+      throw std::logic_error("--closure requires --out");
+    if (!args.count("sysroot"))
+      throw std::logic_error("--closure requires --sysroot");
+    slasher::Hasher hasher(args.count("keep-static"), false);
+    hasher.open(store_path);
+    hasher.select(partition);
+    if (args.count("link-set"))
+      hasher.prune({link_set.begin(), link_set.end()}, jobs);
+    if (journal)
+      hasher.record(*journal);
+    if (!debug_out.empty())
+      hasher.split_debug(debug_dir, args.count("split-debug"));
+    depend(hasher);
+    hash_closure(hasher, closure_path, sysroot, libraries, out_dir, jobs);
+    return 0;
+  }
 
+  if (args.count("input-object-path"))
+    objects.insert(objects.begin(), {input_object_path, output_object_path});
+  auto pairs = object_pairs(objects, list_path);
+  if (args.count("tar") &&
+      (pairs.size() != 1 || journal || depfile || !cache_dir.empty() ||
+       !debug_out.empty()))
+    throw std::logic_error("--tar takes a single input and output, and cannot "
+                           "be combined with --record, --depfile, --cache or "
+                           "--debug-out");
+  if ((journal || depfile || !cache_dir.empty()) && pairs.size() == 1 &&
+      (slasher::is_stdio(pairs[0].first) || slasher::is_stdio(pairs[0].second)))
+    throw std::logic_error(
+        "--record, --depfile and --cache need files, not standard input or "
+        "output");
   slasher::Hasher hasher(args.count("keep-static"));
   hasher.open(store_path);
-  hasher(input_object_path, output_object_path);
-  return 0;
+  hasher.select(partition);
+  hasher.jobs = jobs;
+  if (args.count("link-set"))
+    hasher.prune({link_set.begin(), link_set.end()}, jobs);
+  if (args.count("tar")) {
+    auto result = slasher::rewrite_tar(
+        pairs[0].first, pairs[0].second, jobs,
+        [&](const auto &name, const auto &data) {
+          return hasher.rewrite(name, data);
+        });
+    if (args.count("stats"))
+      slasher::io_stats().report(std::cerr);
+    return result;
+  }
+  if (journal)
+    hasher.record(*journal);
+  if (!debug_out.empty()) {
+    if (pairs.size() == 1 && !std::filesystem::is_directory(pairs[0].first))
+      hasher.split_debug([&](const auto &) { return debug_out; },
+                         args.count("split-debug"));
+    else
+      hasher.split_debug(debug_dir, args.count("split-debug"));
+  }
+  depend(hasher);
+  std::unique_ptr<slasher::Output_cache> cache;
+  if (!cache_dir.empty())
+    cache = std::make_unique<slasher::Output_cache>(cache_dir,
+                                                    hasher.fingerprint());
+  auto result = for_each_pair(pairs, jobs,
+                              [&](const auto &in_path, const auto &out_path,
+                                  const auto &data) {
+                                std::string key;
+                                // Hits are recorded with the names the
+                                // output looked up when it was hashed
+                                std::vector<std::string> names;
+                                auto *tracked =
+                                    hasher.tracking() ? &names : nullptr;
+                                if (cache) {
+                                  key = cache->key(in_path, data);
+                                  if (cache->fetch(key, out_path, tracked)) {
+                                    hasher.record_cached(in_path, out_path,
+                                                         names);
+                                    return;
+                                  }
+                                }
+                                names = hasher(in_path, out_path, data);
+                                if (cache)
+                                  cache->save(key, out_path, tracked);
+                              });
+  if (cache)
+    std::cerr << "cache: " << cache->hits << " hits, " << cache->misses
+              << " misses" << std::endl;
+  if (args.count("stats"))
+    slasher::io_stats().report(std::cerr);
+  return result;
 }
 
 int dehash(int argc, char **argv) {
   std::string store_path;
+  unsigned jobs;
+  std::size_t in_flight;
+  std::string list_path;
   std::string input_object_path;
   std::string output_object_path;
+  std::vector<std::string> objects;
   cxxopts::Options options("symbol-slasher hash", hash_desc);
   // clang-format off
   options.add_options()
       ("h,help", "print this help")
       ("s,symbols", "path to the store of symbol hashes", cxxopts::value(store_path)->default_value("symbols.json"))
+      ("j,jobs", "number of objects to process concurrently", cxxopts::value(jobs)->default_value(std::to_string(slasher::default_jobs())))
+      ("in-flight", "MiB of input to read ahead of processing", cxxopts::value(in_flight)->default_value("256"))
+      ("stats", "report the throughput of reading, processing and writing")
+      ("from-list", "file listing an input:output pair per line", cxxopts::value(list_path))
+      ("tar", "input and output are tar streams, whose objects are dehashed and other files copied")
       ("i,input_object_path", "object to read", cxxopts::value(input_object_path))
       ("o,output_object_path", "new object to create", cxxopts::value(output_object_path))
+      ("objects", "input and output object, or input:output pairs", cxxopts::value(objects))
       ;
   // clang-format on
-  options.parse_positional({"input_object_path", "output_object_path"});
-  options.positional_help("input_object_path output_object_path");
+  options.parse_positional({"objects"});
+  options.positional_help("input_object_path output_object_path | input:output...");
   auto args = options.parse(argc, argv);
 
   if (args.count("help")) {
     std::cout << options.help() << std::endl;
     return 0;
   }
+  slasher::max_in_flight() = in_flight << 20;
 
+  if (args.count("input_object_path"))
+    objects.insert(objects.begin(), {input_object_path, output_object_path});
+  auto pairs = object_pairs(objects, list_path);
   slasher::Dehasher dehasher;
   dehasher.open(store_path);
-  dehasher(input_object_path, output_object_path);
-  return 0;
+  dehasher.jobs = jobs;
+  if (args.count("tar")) {
+    if (pairs.size() != 1)
+      throw std::logic_error("--tar takes a single input and output");
+    auto result = slasher::rewrite_tar(
+        pairs[0].first, pairs[0].second, jobs,
+        [&](const auto &name, const auto &data) {
+          return dehasher.rewrite(name, data);
+        });
+    if (args.count("stats"))
+      slasher::io_stats().report(std::cerr);
+    return result;
+  }
+  auto result = for_each_pair(
+      pairs, jobs,
+      [&](const auto &in_path, const auto &out_path, const auto &data) {
+        dehasher(in_path, out_path, data);
+      });
+  if (args.count("stats"))
+    slasher::io_stats().report(std::cerr);
+  return result;
 }
 
 int list(int argc, char **argv) {
   std::string store_path;
+  std::string format;
+  unsigned jobs;
   std::vector<std::string> object_paths;
   cxxopts::Options options("symbol-slasher list", list_desc);
   // clang-format off
@@ -125,6 +457,9 @@ int list(int argc, char **argv) {
       ("h,help", "print this help")
       ("s,symbols", "path to the store of symbol hashes", cxxopts::value(store_path)->default_value("symbols.json"))
       ("d,demangle", "demangle symbols")
+      ("f,format", "output format: text, json, csv or tsv", cxxopts::value(format)->default_value("text"))
+      ("j,jobs", "number of objects to read concurrently", cxxopts::value(jobs)->default_value(std::to_string(slasher::default_jobs())))
+      ("tar", "list the objects in tar streams (- for standard input)")
       ("object_paths", "paths of objects to read", cxxopts::value(object_paths))
       ;
   // clang-format on
@@ -137,16 +472,608 @@ int list(int argc, char **argv) {
     return 0;
   }
 
-  slasher::Lister lister(args.count("demangle"));
+  const std::map<std::string, slasher::Lister::Format> formats = {
+      {"text", slasher::Lister::text},
+      {"json", slasher::Lister::json},
+      {"csv", slasher::Lister::csv},
+      {"tsv", slasher::Lister::tsv}};
+  if (formats.count(format) == 0)
+    throw std::logic_error("unknown format: " + format);
+  slasher::Lister lister(args.count("demangle"), formats.at(format));
   lister.open(store_path);
-  if (object_paths.size() == 1) {
-    lister(object_paths.front());
-  } else {
-    for (const auto &object_path : object_paths) {
-      std::cout << std::endl << object_path << ":" << std::endl;
-      lister(object_path);
+  if (args.count("tar"))
+    return lister.tar({object_paths.begin(), object_paths.end()}, jobs,
+                      std::cout);
+  object_paths = slasher::expand_objects(object_paths, jobs);
+  return lister({object_paths.begin(), object_paths.end()}, jobs, std::cout);
+}
+
+int rehash(int argc, char **argv) {
+  std::string store_path;
+  std::string journal_path;
+  uint64_t since;
+  unsigned jobs;
+  cxxopts::Options options("symbol-slasher rehash", rehash_desc);
+  // clang-format off
+  options.add_options()
+      ("h,help", "print this help")
+      ("s,symbols", "path to the store of symbol hashes", cxxopts::value(store_path)->default_value("symbols.json"))
+      ("r,record", "journal of hashed outputs", cxxopts::value(journal_path)->default_value("hashed.json"))
+      ("changed-since", "store generation to compare against, instead of the one each output was hashed at", cxxopts::value(since))
+      ("j,jobs", "number of objects to process concurrently", cxxopts::value(jobs)->default_value(std::to_string(slasher::default_jobs())))
+      ;
+  // clang-format on
+  auto args = options.parse(argc, argv);
+
+  if (args.count("help")) {
+    std::cout << options.help() << std::endl;
+    return 0;
+  }
+
+  slasher::Journal journal(journal_path);
+
+  // One hasher for each combination of partition and options in the journal
+  std::map<std::tuple<std::string, bool, bool>,
+           std::unique_ptr<slasher::Hasher>>
+      hashers;
+  std::map<std::filesystem::path, std::filesystem::path> debug_paths;
+  auto debug_path = [&](const std::filesystem::path &out_path) {
+    auto it = debug_paths.find(out_path);
+    return it == debug_paths.end() ? std::filesystem::path() : it->second;
+  };
+  std::map<std::pair<slasher::Hasher *, uint64_t>, std::vector<std::string>>
+      changes;
+  std::map<std::string, const slasher::Hasher *> stale_hashers;
+  std::vector<Object_pair> stale;
+  for (const auto &[out_path, entry] : journal.outputs.items()) {
+    if (entry.value("pruned", false)) {
+      std::cerr << "Skipping " << out_path
+                << ": hashed with --link-set, which is not recorded"
+                << std::endl;
+      continue;
+    }
+    bool debug_sections = entry.value("debug_sections", false);
+    auto &hasher = hashers[{entry["partition"], entry["keep_static"],
+                            debug_sections}];
+    if (!hasher) {
+      hasher = std::make_unique<slasher::Hasher>(entry["keep_static"]);
+      hasher->open(store_path);
+      hasher->select(entry["partition"]);
+      hasher->record(journal);
+      hasher->split_debug(debug_path, debug_sections);
+      hasher->jobs = jobs;
+    }
+    if (entry.count("debug"))
+      debug_paths[out_path] = entry["debug"].get<std::string>();
+
+    auto output_since = args.count("changed-since")
+                            ? since
+                            : entry["generation"].get<uint64_t>();
+    auto [changed, inserted] = changes.try_emplace({hasher.get(), output_since});
+    if (inserted)
+      changed->second = hasher->changed_since(output_since);
+    slasher::Bloom lookups(entry["names"].get<std::string>());
+    if (std::any_of(changed->second.begin(), changed->second.end(),
+                    [&](const auto &name) { return lookups.contains(name); })) {
+      stale.emplace_back(entry["input"], out_path);
+      stale_hashers[out_path] = hasher.get();
+    }
+  }
+
+  std::cout << "Rehashing " << stale.size() << " of "
+            << journal.outputs.size() << " outputs" << std::endl;
+  return for_each_pair(
+      stale, jobs,
+      [&](const auto &in_path, const auto &out_path, const auto &data) {
+        (*stale_hashers.at(out_path))(in_path, out_path, data);
+      });
+}
+
+int renumber(int argc, char **argv) {
+  std::string store_path;
+  std::string plan_path;
+  std::vector<std::string> object_paths;
+  cxxopts::Options options("symbol-slasher renumber", renumber_desc);
+  // clang-format off
+  options.add_options()
+      ("h,help", "print this help")
+      ("s,symbols", "path to the store of symbol hashes", cxxopts::value(store_path)->default_value("symbols.json"))
+      ("p,plan", "path of the rehash plan to create", cxxopts::value(plan_path)->default_value("rehash.json"))
+      ("object_paths", "paths of objects to count references in", cxxopts::value(object_paths))
+      ;
+  // clang-format on
+  options.parse_positional({"object_paths"});
+  options.positional_help("object_path(s)...");
+  auto args = options.parse(argc, argv);
+
+  if (args.count("help")) {
+    std::cout << options.help() << std::endl;
+    return 0;
+  }
+
+  slasher::Renumberer renumberer;
+  renumberer.open(store_path);
+  object_paths = slasher::expand_objects(object_paths, slasher::default_jobs());
+  for (const auto &object_path : object_paths)
+    renumberer(object_path);
+  std::ofstream plan_stream(plan_path);
+  if (!plan_stream.is_open())
+    throw std::logic_error("failed to open rehash plan");
+  plan_stream << renumberer.renumber().dump(2) << std::endl;
+  return 0;
+}
+
+int pipeline(int argc, char **argv) {
+  std::string store_path;
+  unsigned jobs;
+  std::size_t in_flight;
+  std::string manifest_path;
+  cxxopts::Options options("symbol-slasher pipeline", pipeline_desc);
+  // clang-format off
+  options.add_options()
+      ("h,help", "print this help")
+      ("s,symbols", "path to the store of symbol hashes", cxxopts::value(store_path)->default_value("symbols.json"))
+      ("j,jobs", "number of objects to process concurrently", cxxopts::value(jobs)->default_value(std::to_string(slasher::default_jobs())))
+      ("in-flight", "MiB of input to read ahead of processing", cxxopts::value(in_flight)->default_value("256"))
+      ("stats", "report the throughput of reading, processing and writing")
+      ("manifest", "JSON manifest of objects, their roles and outputs", cxxopts::value(manifest_path))
+      ;
+  // clang-format on
+  options.parse_positional({"manifest"});
+  options.positional_help("manifest");
+  auto args = options.parse(argc, argv);
+
+  if (args.count("help") || !args.count("manifest")) {
+    std::cout << options.help() << std::endl;
+    return 0;
+  }
+  slasher::max_in_flight() = in_flight << 20;
+
+  std::ifstream manifest_stream(manifest_path);
+  if (!manifest_stream.is_open())
+    throw std::logic_error("Could not open manifest " + manifest_path);
+  json manifest;
+  manifest_stream >> manifest;
+
+  // Each object is inserted, hashed, or both
+  struct Entry {
+    std::filesystem::path input, output;
+    bool insert = false, hash = false;
+  };
+  std::vector<Entry> entries;
+  std::vector<std::filesystem::path> paths;
+  for (const auto &object : manifest["objects"]) {
+    Entry entry;
+    entry.input = object["input"].get<std::string>();
+    for (const auto &role : object["roles"]) {
+      if (role == "insert")
+        entry.insert = true;
+      else if (role == "hash")
+        entry.hash = true;
+      else
+        throw std::logic_error("unknown role " + role.dump());
+    }
+    if (entry.hash) {
+      if (!object.count("output"))
+        throw std::logic_error(entry.input.string() + " has no output");
+      entry.output = object["output"].get<std::string>();
+    }
+    entries.push_back(entry);
+    paths.push_back(entry.input);
+  }
+
+  slasher::Hasher hasher(manifest.value("keep_static", false), false);
+  hasher.open(store_path);
+  hasher.select(manifest.value("partition", ""), manifest.value("prefix", ""));
+  hasher.jobs = jobs;
+
+  // Each object is read and parsed once.  The parse (or, for relocatable
+  // objects and archives, the content) of objects to hash is kept for the
+  // hash phase, since every insertion must come first.  Objects whose content
+  // was already inserted are not inserted again, and are only parsed if they
+  // are hashed.
+  std::vector<slasher::Object_symbols> symbols(entries.size());
+  std::vector<std::string> digests(entries.size());
+  std::vector<std::string> build_ids(entries.size());
+  std::vector<char> inserting(entries.size(), false);
+  std::vector<std::unique_ptr<LIEF::ELF::Binary>> parsed(entries.size());
+  std::vector<std::vector<uint8_t>> contents(entries.size());
+  slasher::pipeline(paths, jobs, [&](std::size_t i, auto &data) {
+    const auto &entry = entries[i];
+    if (entry.insert) {
+      slasher::Digest digest;
+      digest.update(data.data(), data.size());
+      digests[i] = digest.hex();
+      inserting[i] = !hasher.inserted_digest(digests[i]);
+      if (inserting[i])
+        build_ids[i] = slasher::read_build_id(data);
+    }
+    if (!inserting[i] && !entry.hash)
+      return;
+    if (slasher::is_static(data)) {
+      if (inserting[i])
+        symbols[i] = slasher::object_symbols(data, entry.input);
+      if (entry.hash)
+        contents[i] = std::move(data);
+    } else {
+      auto object = slasher::load_binary(data, entry.input);
+      if (inserting[i])
+        symbols[i] = slasher::object_symbols(*object);
+      if (entry.hash)
+        parsed[i] = std::move(object);
+    }
+  });
+
+  // Inserted in manifest order, so the ids match those of inserting the
+  // objects in turn
+  for (std::size_t i = 0; i < entries.size(); i++) {
+    if (!inserting[i])
+      continue;
+    for (const auto &name : symbols[i].defined)
+      hasher.insert(name);
+    hasher.inserted(entries[i].input, digests[i], build_ids[i]);
+  }
+
+  std::atomic<std::size_t> failed(0);
+  slasher::parallel_for(entries.size(), jobs, [&](std::size_t i) {
+    const auto &entry = entries[i];
+    if (!entry.hash)
+      return;
+    try {
+      if (entry.output.has_parent_path())
+        std::filesystem::create_directories(entry.output.parent_path());
+      if (parsed[i])
+        hasher(entry.input, entry.output, parsed[i]);
+      else
+        hasher(entry.input, entry.output, contents[i]);
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " + entry.input.string() + ": " + e.what() + "\n";
+      failed++;
+    }
+    parsed[i].reset();
+    contents[i] = {};
+  });
+  if (args.count("stats"))
+    slasher::io_stats().report(std::cerr);
+  // The store is written once, when the hasher goes out of scope
+  return failed == 0 ? 0 : 1;
+}
+
+int watch(int argc, char **argv) {
+  std::string store_path;
+  std::string partition;
+  std::string journal_path;
+  unsigned jobs;
+  unsigned quiet;
+  std::vector<std::string> dirs;
+  cxxopts::Options options("symbol-slasher watch", watch_desc);
+  // clang-format off
+  options.add_options()
+      ("h,help", "print this help")
+      ("s,symbols", "path to the store of symbol hashes", cxxopts::value(store_path)->default_value("symbols.json"))
+      ("p,partition", "partition of the store to insert into and hash from", cxxopts::value(partition))
+      ("k,keep-static", "do not discard static symbols")
+      ("r,record", "journal of hashed outputs", cxxopts::value(journal_path)->default_value("hashed.json"))
+      ("j,jobs", "number of objects to process concurrently", cxxopts::value(jobs)->default_value(std::to_string(slasher::default_jobs())))
+      ("quiet", "milliseconds without writes that end a burst of changes", cxxopts::value(quiet)->default_value("100"))
+      ("dirs", "input:output directory pairs", cxxopts::value(dirs))
+      ;
+  // clang-format on
+  options.parse_positional({"dirs"});
+  options.positional_help("input:output...");
+  auto args = options.parse(argc, argv);
+
+  if (args.count("help") || dirs.empty()) {
+    std::cout << options.help() << std::endl;
+    return 0;
+  }
+
+  std::vector<std::pair<std::filesystem::path, std::filesystem::path>> roots;
+  for (const auto &[in_dir, out_dir] : object_pairs(dirs, "")) {
+    auto in_root = std::filesystem::canonical(in_dir);
+    std::filesystem::create_directories(out_dir);
+    auto out_root = std::filesystem::canonical(out_dir);
+    auto inside = out_root.lexically_relative(in_root);
+    if (!inside.empty() && *inside.begin() != "..")
+      throw std::logic_error("output " + out_dir + " is inside watched " +
+                             in_dir);
+    roots.emplace_back(in_root, out_root);
+  }
+
+  // The store stays loaded, and is written after every batch
+  bool keep_static = args.count("keep-static");
+  slasher::Hasher hasher(keep_static, false);
+  hasher.open(store_path);
+  hasher.select(partition);
+  hasher.jobs = jobs;
+  slasher::Journal journal(journal_path);
+  hasher.record(journal);
+
+  // Objects that could not be read, such as ones caught while being written,
+  // are tried again with the next burst
+  std::vector<Object_pair> retry;
+
+  // Inserts the symbols defined by the changed objects, then hashes them
+  // along with every recorded output that looks up a name that is new to the
+  // store.  Returns nonzero if any object failed.
+  auto process = [&](std::vector<Object_pair> changed) {
+    auto start = std::chrono::steady_clock::now();
+    for (const auto &pair : retry)
+      if (std::filesystem::exists(pair.first) &&
+          std::find(changed.begin(), changed.end(), pair) == changed.end())
+        changed.push_back(pair);
+    retry.clear();
+    std::vector<std::filesystem::path> objects;
+    for (const auto &[in_path, out_path] : changed)
+      objects.push_back(in_path);
+    std::vector<slasher::Object_symbols> symbols(objects.size());
+    std::vector<char> unreadable(objects.size(), false);
+    auto report = [&](std::size_t i, const std::string &error) {
+      std::cerr << "Error: " + objects[i].string() + ": " + error +
+                       " (trying again on the next change)\n";
+      unreadable[i] = true;
+    };
+    slasher::pipeline(
+        objects, jobs,
+        [&](std::size_t i, const auto &data) {
+          try {
+            symbols[i] = slasher::object_symbols(data, objects[i]);
+          } catch (const std::exception &e) {
+            report(i, e.what());
+          }
+        },
+        report);
+    auto since = hasher.current_generation();
+    std::vector<Object_pair> stale;
+    for (std::size_t i = 0; i < changed.size(); i++) {
+      if (unreadable[i]) {
+        retry.push_back(changed[i]);
+        continue;
+      }
+      for (const auto &name : symbols[i].defined)
+        hasher.insert(name);
+      stale.push_back(changed[i]);
+    }
+    auto inserted = hasher.changed_since(since);
+
+    std::set<std::string> changed_outputs;
+    for (const auto &[in_path, out_path] : changed)
+      changed_outputs.insert(out_path);
+    for (const auto &[out_path, entry] : journal.outputs.items()) {
+      if (changed_outputs.count(out_path) || entry["partition"] != partition ||
+          entry["keep_static"] != keep_static ||
+          entry.value("pruned", false) || entry.count("debug"))
+        continue;
+      slasher::Bloom lookups(entry["names"].get<std::string>());
+      if (std::any_of(inserted.begin(), inserted.end(),
+                      [&](const auto &name) { return lookups.contains(name); }))
+        stale.emplace_back(entry["input"], out_path);
+    }
+    for (const auto &[in_path, out_path] : stale)
+      std::filesystem::create_directories(
+          std::filesystem::path(out_path).parent_path());
+    auto result = for_each_pair(
+        stale, jobs,
+        [&](const auto &in_path, const auto &out_path, const auto &data) {
+          hasher(in_path, out_path, data);
+        });
+    hasher.flush();
+    journal.flush();
+    auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+    std::cout << changed.size() << " changed, " << inserted.size()
+              << " inserted, " << stale.size() << " hashed in "
+              << elapsed.count() << " ms" << std::endl;
+    return retry.empty() ? result : 1;
+  };
+
+  // Changes made while the first pass runs are still seen
+  slasher::stop_watching();
+  slasher::Watcher watcher;
+  std::vector<Object_pair> initial;
+  for (const auto &[in_root, out_root] : roots) {
+    watcher.add(in_root);
+    for (const auto &entry : slasher::walk_tree(in_root, jobs)) {
+      auto in_path = in_root / entry.path, out_path = out_root / entry.path;
+      if (entry.kind == slasher::Tree_entry::elf) {
+        initial.emplace_back(in_path.string(), out_path.string());
+      } else if (entry.kind == slasher::Tree_entry::file) {
+        std::filesystem::create_directories(out_path.parent_path());
+        std::filesystem::copy_file(
+            in_path, out_path, std::filesystem::copy_options::update_existing);
+      }
+    }
+  }
+  auto result = process(initial);
+
+  for (;;) {
+    auto paths = watcher.wait(std::chrono::milliseconds(quiet));
+    if (paths.empty())
+      break;
+    std::vector<Object_pair> changed;
+    for (const auto &path : paths) {
+      for (const auto &[in_root, out_root] : roots) {
+        auto relative = path.lexically_relative(in_root);
+        if (relative.empty() || *relative.begin() == "..")
+          continue;
+        auto out_path = out_root / relative;
+        if (slasher::is_elf(path) || slasher::is_archive(path)) {
+          changed.emplace_back(path.string(), out_path.string());
+        } else if (std::filesystem::is_regular_file(path)) {
+          // Other files are mirrored as they are
+          std::filesystem::create_directories(out_path.parent_path());
+          std::filesystem::copy_file(
+              path, out_path, std::filesystem::copy_options::overwrite_existing);
+        }
+        break;
+      }
+    }
+    if (!changed.empty() || !retry.empty())
+      result = std::max(result, process(changed));
+  }
+  return result;
+}
+
+int search(int argc, char **argv) {
+  std::string store_path;
+  unsigned jobs;
+  std::string query;
+  cxxopts::Options options("symbol-slasher search", search_desc);
+  // clang-format off
+  options.add_options()
+      ("h,help", "print this help")
+      ("s,symbols", "path to the store of symbol hashes", cxxopts::value(store_path)->default_value("symbols.json"))
+      ("e,regex", "treat the query as an ECMAScript regular expression")
+      ("j,jobs", "number of threads checking candidates", cxxopts::value(jobs)->default_value(std::to_string(slasher::default_jobs())))
+      ("query", "text to find in mangled or demangled names", cxxopts::value(query))
+      ;
+  // clang-format on
+  options.parse_positional({"query"});
+  options.positional_help("query");
+  auto args = options.parse(argc, argv);
+
+  if (args.count("help") || !args.count("query")) {
+    std::cout << options.help() << std::endl;
+    return 0;
+  }
+
+  slasher::Search_index index(store_path, jobs);
+  std::string out;
+  for (const auto &match : index.find(query, args.count("regex"))) {
+    out += match.hashed;
+    out += '\t';
+    out += std::to_string(match.hash);
+    out += '\t';
+    out += match.name;
+    out += '\t';
+    out += match.demangled;
+    out += '\n';
+  }
+  std::cout << out << std::flush;
+  return 0;
+}
+
+int dehash_text(int argc, char **argv) {
+  std::string store_path;
+  std::vector<std::string> paths;
+  cxxopts::Options options("symbol-slasher dehash-text", dehash_text_desc);
+  // clang-format off
+  options.add_options()
+      ("h,help", "print this help")
+      ("s,symbols", "path to the store of symbol hashes", cxxopts::value(store_path)->default_value("symbols.json"))
+      ("d,demangle", "demangle symbols")
+      ("paths", "text files to read (- or none for standard input)", cxxopts::value(paths))
+      ;
+  // clang-format on
+  options.parse_positional({"paths"});
+  options.positional_help("[path...]");
+  auto args = options.parse(argc, argv);
+
+  if (args.count("help")) {
+    std::cout << options.help() << std::endl;
+    return 0;
+  }
+
+  if (paths.empty())
+    paths.push_back("-");
+  slasher::Text_dehasher dehasher(args.count("demangle"));
+  dehasher.open(store_path);
+  for (const auto &path : paths) {
+    auto fd = slasher::open_text(path);
+    dehasher(fd, STDOUT_FILENO);
+    if (fd != STDIN_FILENO)
+      ::close(fd);
+  }
+  return 0;
+}
+
+int symbolize(int argc, char **argv) {
+  std::string store_path;
+  std::string cache_dir;
+  std::string queries_path;
+  std::vector<std::string> modules;
+  cxxopts::Options options("symbol-slasher symbolize", symbolize_desc);
+  // clang-format off
+  options.add_options()
+      ("h,help", "print this help")
+      ("s,symbols", "path to the store of symbol hashes", cxxopts::value(store_path)->default_value("symbols.json"))
+      ("c,cache", "directory of module indexes (default: the store path with .symbolize appended)", cxxopts::value(cache_dir))
+      ("d,demangle", "demangle symbols")
+      ("q,queries", "file of build-id and offset pairs, one per line (- for standard input, read by default when no modules are given)", cxxopts::value(queries_path))
+      ("modules", "hashed modules to index", cxxopts::value(modules))
+      ;
+  // clang-format on
+  options.parse_positional({"modules"});
+  options.positional_help("[module...]");
+  auto args = options.parse(argc, argv);
+
+  if (args.count("help")) {
+    std::cout << options.help() << std::endl;
+    return 0;
+  }
+
+  if (cache_dir.empty())
+    cache_dir = store_path + ".symbolize";
+  slasher::Symbolizer symbolizer(store_path, cache_dir);
+  for (const auto &module : modules)
+    symbolizer.add(module);
+  if (queries_path.empty()) {
+    if (!modules.empty())
+      return 0;
+    queries_path = "-";
+  }
+
+  std::ifstream file;
+  if (!slasher::is_stdio(queries_path)) {
+    file.open(queries_path);
+    if (!file)
+      throw std::logic_error("Could not open " + queries_path);
+  }
+  std::istream &queries = file.is_open() ? file : std::cin;
+  bool demangle = args.count("demangle");
+  slasher::Demangler demangler;
+  std::string out;
+  std::string line;
+  // Each line is echoed, followed by the symbol and offset into it, or ??
+  while (std::getline(queries, line)) {
+    auto id_begin = line.find_first_not_of(" \t");
+    if (id_begin == std::string::npos)
+      continue;
+    auto id_end = line.find_first_of(" \t", id_begin);
+    auto build_id = line.substr(id_begin, id_end - id_begin);
+    std::transform(build_id.begin(), build_id.end(), build_id.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    auto offset_begin = line.find_first_not_of(" \t", id_end);
+    const auto *index = symbolizer.index(build_id);
+
+    out += line;
+    out += '\t';
+    std::optional<slasher::Symbol_index::Location> location;
+    if (index && offset_begin != std::string::npos) {
+      char *end;
+      auto address = std::strtoull(line.c_str() + offset_begin, &end, 16);
+      if (end != line.c_str() + offset_begin)
+        location = index->find(address);
+    }
+    if (!location) {
+      out += "??\n";
+    } else {
+      if (demangle)
+        out += demangler(std::string(location->name));
+      else
+        out += location->name;
+      char hex[16];
+      auto result = std::to_chars(hex, hex + sizeof(hex), location->offset, 16);
+      out += "+0x";
+      out.append(hex, result.ptr);
+      out += '\n';
+    }
+    if (out.size() >= (1 << 20)) {
+      std::cout << out;
+      out.clear();
     }
   }
+  std::cout << out << std::flush;
   return 0;
 }
 
@@ -158,10 +1085,17 @@ void help() {
   std::cout << "  symbol-slasher <command> -h | --help  Print command help." << std::endl;
   std::cout << std::endl;
   std::cout << "Commands:" << std::endl;
-  std::cout << "  insert   " << insert_desc << std::endl;
-  std::cout << "  hash     " << hash_desc << std::endl;
-  std::cout << "  dehash   " << dehash_desc << std::endl;
-  std::cout << "  list     " << list_desc << std::endl;
+  std::cout << "  insert      " << insert_desc << std::endl;
+  std::cout << "  hash        " << hash_desc << std::endl;
+  std::cout << "  dehash      " << dehash_desc << std::endl;
+  std::cout << "  dehash-text " << dehash_text_desc << std::endl;
+  std::cout << "  list        " << list_desc << std::endl;
+  std::cout << "  rehash      " << rehash_desc << std::endl;
+  std::cout << "  renumber    " << renumber_desc << std::endl;
+  std::cout << "  pipeline    " << pipeline_desc << std::endl;
+  std::cout << "  watch       " << watch_desc << std::endl;
+  std::cout << "  search      " << search_desc << std::endl;
+  std::cout << "  symbolize   " << symbolize_desc << std::endl;
   // clang-format on
   std::exit(0);
 }
@@ -179,8 +1113,22 @@ int main(int argc, char **argv) try {
     call_mode(hash);
   } else if (mode == "dehash") {
     call_mode(dehash);
+  } else if (mode == "dehash-text") {
+    call_mode(dehash_text);
   } else if (mode == "list") {
     call_mode(list);
+  } else if (mode == "rehash") {
+    call_mode(rehash);
+  } else if (mode == "renumber") {
+    call_mode(renumber);
+  } else if (mode == "pipeline") {
+    call_mode(pipeline);
+  } else if (mode == "watch") {
+    call_mode(watch);
+  } else if (mode == "search") {
+    call_mode(search);
+  } else if (mode == "symbolize") {
+    call_mode(symbolize);
   } else {
     throw std::logic_error("invalid command");
   }
@@ -0,0 +1,235 @@
+/* output.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_OUTPUT_H_
+#define SYMBOL_SLASHER_OUTPUT_H_
+
+#include "io.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <linux/fs.h>
+#include <stdexcept>
+#include <string>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace slasher {
+
+// A file descriptor that is closed when it goes out of scope
+struct File {
+  File(int fd) : fd(fd) {}
+  File(const File &) = delete;
+  ~File() {
+    if (fd >= 0)
+      ::close(fd);
+  }
+  int fd;
+};
+
+// Copies the whole of one file into another, sharing storage with a reflink
+// where the filesystem supports it, and copying in the kernel otherwise
+void clone_file(int in, int out) {
+  if (::ioctl(out, FICLONE, in) == 0)
+    return;
+  struct stat info;
+  if (::fstat(in, &info) != 0)
+    throw std::logic_error("Could not read object file");
+  loff_t in_offset = 0, out_offset = 0;
+  while (in_offset < info.st_size) {
+    auto copied = ::copy_file_range(in, &in_offset, out, &out_offset,
+                                    info.st_size - in_offset, 0);
+    if (copied <= 0) {
+      // Not supported between these files; copy through user space instead
+      std::vector<char> buffer(1 << 20);
+      for (;;) {
+        auto size = ::pread(in, buffer.data(), buffer.size(), in_offset);
+        if (size < 0)
+          throw std::logic_error("Could not read object file");
+        if (size == 0)
+          break;
+        if (::pwrite(out, buffer.data(), size, out_offset) != size)
+          throw std::logic_error("Could not write object file");
+        in_offset += size;
+        out_offset += size;
+      }
+      return;
+    }
+  }
+}
+
+// Returns the path of a new temporary file next to out_path, for writing an
+// output that is then renamed into place
+std::string temp_file(const std::filesystem::path &out_path, File &file) {
+  auto dir = out_path.parent_path().empty() ? std::filesystem::path(".")
+                                            : out_path.parent_path();
+  auto temp_path =
+      (dir / ("." + out_path.filename().string() + ".XXXXXX")).string();
+  file.fd = ::mkostemp(temp_path.data(), O_CLOEXEC);
+  if (file.fd < 0)
+    throw std::logic_error("Could not open object file for writing");
+  return temp_path;
+}
+
+// Whether a file already has the given content and permissions.  Outputs
+// that would not change are left alone, so their modification time only
+// changes with their content and build systems can skip their dependents.
+bool unchanged(const std::filesystem::path &out_path,
+               const std::vector<uint8_t> &content, mode_t mode) {
+  File out(::open(out_path.c_str(), O_RDONLY | O_CLOEXEC));
+  struct stat info;
+  if (out.fd < 0 || ::fstat(out.fd, &info) != 0 ||
+      std::size_t(info.st_size) != content.size() ||
+      (info.st_mode & 07777) != (mode & 07777))
+    return false;
+  std::vector<uint8_t> buffer(1 << 20);
+  for (std::size_t offset = 0; offset < content.size();) {
+    auto size = ::pread(out.fd, buffer.data(),
+                        std::min(buffer.size(), content.size() - offset),
+                        offset);
+    if (size <= 0 ||
+        std::memcmp(buffer.data(), content.data() + offset, size) != 0)
+      return false;
+    offset += size;
+  }
+  return true;
+}
+
+// Writes all of data to a file descriptor
+void write_all(int fd, const void *data, std::size_t size) {
+  auto bytes = static_cast<const uint8_t *>(data);
+  for (std::size_t offset = 0; offset < size;) {
+    auto written = ::write(fd, bytes + offset, size - offset);
+    if (written < 0 && errno == EINTR)
+      continue;
+    if (written <= 0)
+      throw std::logic_error("Could not write object file");
+    offset += written;
+  }
+}
+
+void write_all(int fd, const std::vector<uint8_t> &content) {
+  write_all(fd, content.data(), content.size());
+}
+
+// Writes a file that has no input to start from, such as a debug file
+void write_file(const std::filesystem::path &out_path,
+                const std::vector<uint8_t> &content, mode_t mode = 0644) {
+  Stage_timer timer(io_stats().write, content.size());
+  if (unchanged(out_path, content, mode))
+    return;
+  File out(-1);
+  auto temp_path = temp_file(out_path, out);
+  try {
+    write_all(out.fd, content);
+    if (::fchmod(out.fd, mode) != 0 || ::fsync(out.fd) != 0)
+      throw std::logic_error("Could not write object file");
+    std::filesystem::rename(temp_path, out_path);
+  } catch (...) {
+    ::unlink(temp_path.c_str());
+    throw;
+  }
+}
+
+// Writes new content for an object that was read from in_path.  The output
+// starts as a clone of the input, and only the blocks that differ from it are
+// written, so large unchanged regions (such as debug information) are neither
+// copied through user space nor unshared from the input.  The output is
+// assembled in a temporary file and renamed into place, so in_path may equal
+// out_path and a crash never leaves a partial output.  An output that already
+// has this content is not touched.
+//
+// Either path may be "-".  Output to standard output is written as it is, and
+// output read from standard input takes the permissions of a redirected file,
+// or those of an executable otherwise.
+void write_patched(const std::filesystem::path &in_path,
+                   const std::filesystem::path &out_path,
+                   const std::vector<uint8_t> &content) {
+  if (is_stdio(out_path)) {
+    Stage_timer timer(io_stats().write, content.size());
+    write_all(STDOUT_FILENO, content);
+    return;
+  }
+  if (is_stdio(in_path)) {
+    struct stat info;
+    bool redirected = ::fstat(STDIN_FILENO, &info) == 0 && S_ISREG(info.st_mode);
+    write_file(out_path, content, redirected ? info.st_mode & 07777 : 0755);
+    return;
+  }
+
+  constexpr std::size_t block = 4096;
+  Stage_timer timer(io_stats().write, content.size());
+
+  File in(::open(in_path.c_str(), O_RDONLY | O_CLOEXEC));
+  struct stat info;
+  if (in.fd < 0 || ::fstat(in.fd, &info) != 0)
+    throw std::logic_error("Could not open object file for reading");
+  if (unchanged(out_path, content, info.st_mode))
+    return;
+
+  File out(-1);
+  auto temp_path = temp_file(out_path, out);
+  try {
+    clone_file(in.fd, out.fd);
+
+    std::size_t in_size = info.st_size;
+    const uint8_t *original = nullptr;
+    void *mapping = MAP_FAILED;
+    if (in_size > 0) {
+      mapping = ::mmap(nullptr, in_size, PROT_READ, MAP_PRIVATE, in.fd, 0);
+      if (mapping == MAP_FAILED)
+        throw std::logic_error("Could not read object file");
+      original = static_cast<const uint8_t *>(mapping);
+    }
+    for (std::size_t offset = 0; offset < content.size(); offset += block) {
+      auto size = std::min(block, content.size() - offset);
+      if (offset + size <= in_size &&
+          std::memcmp(original + offset, content.data() + offset, size) == 0)
+        continue;
+      if (::pwrite(out.fd, content.data() + offset, size, offset) !=
+          static_cast<ssize_t>(size)) {
+        if (mapping != MAP_FAILED)
+          ::munmap(mapping, in_size);
+        throw std::logic_error("Could not write object file");
+      }
+    }
+    if (mapping != MAP_FAILED)
+      ::munmap(mapping, in_size);
+
+    // Copy file permissions
+    if (::ftruncate(out.fd, content.size()) != 0 ||
+        ::fchmod(out.fd, info.st_mode & 07777) != 0 || ::fsync(out.fd) != 0)
+      throw std::logic_error("Could not write object file");
+    std::filesystem::rename(temp_path, out_path);
+  } catch (...) {
+    ::unlink(temp_path.c_str());
+    throw;
+  }
+}
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_OUTPUT_H_
@@ -0,0 +1,139 @@
+/* pool.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_POOL_H_
+#define SYMBOL_SLASHER_POOL_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace slasher {
+
+unsigned default_jobs() {
+  return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// A queue of work items owned by one worker.  The owner takes items from the
+// front, and idle workers steal from the back.
+struct Work_queue {
+  bool pop(std::size_t &item) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (items.empty())
+      return false;
+    item = items.front();
+    items.pop_front();
+    return true;
+  }
+
+  bool steal(std::size_t &item) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (items.empty())
+      return false;
+    item = items.back();
+    items.pop_back();
+    return true;
+  }
+
+  std::mutex mutex;
+  std::deque<std::size_t> items;
+};
+
+// Calls func(i) for every i in [0, count) on up to jobs threads.  Each thread
+// starts with a contiguous share of the items and steals from the others once
+// its own share runs out, so a few slow items do not leave threads idle.  The
+// first exception thrown by any call is rethrown once all threads have
+// finished.
+template <typename Func>
+void parallel_for(std::size_t count, unsigned jobs, Func func) {
+  auto thread_count = std::min<std::size_t>(std::max(1u, jobs), count);
+  if (thread_count == 0)
+    return;
+  std::vector<Work_queue> queues(thread_count);
+  for (std::size_t i = 0; i < count; i++)
+    queues[i * thread_count / count].items.push_back(i);
+
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto worker = [&](std::size_t self) {
+    std::size_t item;
+    for (;;) {
+      bool found = queues[self].pop(item);
+      for (std::size_t other = 1; !found && other < thread_count; other++)
+        found = queues[(self + other) % thread_count].steal(item);
+      if (!found)
+        break;
+      try {
+        func(item);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (std::size_t i = 1; i < thread_count; i++)
+    threads.emplace_back(worker, i);
+  worker(0);
+  for (auto &thread : threads)
+    thread.join();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+// Like parallel_for, but items are started in increasing order, for consumers
+// of a stream that is produced in that order
+template <typename Func>
+void parallel_for_in_order(std::size_t count, unsigned jobs, Func func) {
+  std::atomic<std::size_t> next(0);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto worker = [&]() {
+    for (auto i = next++; i < count; i = next++) {
+      try {
+        func(i);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(error_mutex);
+        if (!error)
+          error = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  auto thread_count = std::min<std::size_t>(std::max(1u, jobs), count);
+  for (std::size_t i = 1; i < thread_count; i++)
+    threads.emplace_back(worker);
+  worker();
+  for (auto &thread : threads)
+    thread.join();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_POOL_H_
@@ -0,0 +1,262 @@
+/* relocatable.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_RELOCATABLE_H_
+#define SYMBOL_SLASHER_RELOCATABLE_H_
+
+#include "elf_types.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Relocatable objects (.o files) have no dynamic symbols, and their names live
+// in .symtab.  Relocations refer to symbols by index, so renaming only
+// rewrites the string table and the name offsets, which is done directly
+// rather than through LIEF.
+
+namespace slasher {
+
+// A symbol from the symbol table of a relocatable object
+struct Static_symbol {
+  std::string name;
+  uint64_t value;
+  unsigned char binding;
+  bool defined;
+};
+
+template <typename T>
+T read_struct(const uint8_t *data, std::size_t size, uint64_t offset) {
+  if (offset > size || size - offset < sizeof(T))
+    throw std::logic_error("truncated object file");
+  T value;
+  std::memcpy(&value, data + offset, sizeof(T));
+  return value;
+}
+
+bool is_relocatable(const uint8_t *data, std::size_t size) {
+  if (size < elf::ident_size + 2 ||
+      std::memcmp(data, elf::magic, sizeof(elf::magic)) != 0)
+    return false;
+  uint16_t type;
+  std::memcpy(&type, data + elf::ident_size, sizeof(type));
+  if (data[elf::data_offset] != elf::host_data)
+    type = uint16_t(type << 8 | type >> 8);
+  return type == elf::et_rel;
+}
+
+bool is_relocatable(const std::vector<uint8_t> &content) {
+  return is_relocatable(content.data(), content.size());
+}
+
+// The symbol table of a relocatable object and the string table it names
+// symbols from
+template <typename Types> struct Symbol_table {
+  using Shdr = typename Types::Shdr;
+  using Sym = typename Types::Sym;
+
+  Symbol_table(const uint8_t *data, std::size_t size) : data(data), size(size) {
+    auto header = read_struct<typename Types::Ehdr>(data, size, 0);
+    if (header.e_shoff == 0)
+      return;
+    uint64_t count = header.e_shnum;
+    uint32_t names_index = header.e_shstrndx;
+    // Past 0xff00 sections, the counts are kept in the first section header
+    auto first = read_struct<Shdr>(data, size, header.e_shoff);
+    if (count == 0)
+      count = first.sh_size;
+    if (names_index == elf::shn_xindex)
+      names_index = first.sh_link;
+    for (uint64_t i = 0; i < count; i++) {
+      auto offset = header.e_shoff + i * header.e_shentsize;
+      sections.push_back({offset, read_struct<Shdr>(data, size, offset)});
+    }
+    // Section names are needed even without a symbol table, such as for
+    // splitting a stripped object's debug sections
+    section_names = names_index;
+
+    for (std::size_t i = 0; i < sections.size(); i++) {
+      if (sections[i].second.sh_type != elf::sht_symtab)
+        continue;
+      symtab = i;
+      strtab = sections[i].second.sh_link;
+      if (strtab >= sections.size())
+        throw std::logic_error("symbol table has no string table");
+      break;
+    }
+    if (symtab == 0)
+      return;
+    shares_names = names_index == strtab;
+    for (std::size_t i = 0; i < sections.size(); i++)
+      if (i != symtab && sections[i].second.sh_link == strtab &&
+          sections[i].second.sh_type != 0)
+        throw std::logic_error("string table is shared with other sections");
+
+    const auto &table = sections[symtab].second;
+    for (uint64_t i = 0; i < table.sh_size / sizeof(Sym); i++)
+      symbols.push_back(
+          read_struct<Sym>(data, size, table.sh_offset + i * sizeof(Sym)));
+  }
+
+  std::string string(uint32_t offset) const {
+    return string(strtab, offset);
+  }
+
+  std::string section_name(std::size_t i) const {
+    if (section_names >= sections.size())
+      return "";
+    return string(section_names, sections[i].second.sh_name);
+  }
+
+  std::string string(std::size_t table_index, uint32_t offset) const {
+    const auto &table = sections[table_index].second;
+    if (offset >= table.sh_size || table.sh_offset + table.sh_size > size)
+      throw std::logic_error("name is out of bounds");
+    auto begin = reinterpret_cast<const char *>(data + table.sh_offset);
+    return std::string(begin + offset,
+                       strnlen(begin + offset, table.sh_size - offset));
+  }
+
+  static bool global(const Sym &symbol) {
+    return (symbol.st_info >> 4) != elf::stb_local && symbol.st_name != 0;
+  }
+
+  std::vector<Static_symbol> read() const {
+    std::vector<Static_symbol> result;
+    for (const auto &symbol : symbols)
+      if (symbol.st_name != 0)
+        result.push_back({string(symbol.st_name), symbol.st_value,
+                          static_cast<unsigned char>(symbol.st_info >> 4),
+                          symbol.st_shndx != elf::shn_undef});
+    return result;
+  }
+
+  // Renames global symbols in content, returning whether any name changed.
+  // The string table is rebuilt with only the names in use, in place if it
+  // fits and at the end of the file otherwise.
+  template <typename Rename>
+  bool rename(std::vector<uint8_t> &content, const Rename &rename) const {
+    std::vector<std::string> names(symbols.size());
+    bool renamed = false;
+    for (std::size_t i = 0; i < symbols.size(); i++) {
+      if (!global(symbols[i]))
+        continue;
+      auto name = string(symbols[i].st_name);
+      names[i] = rename(name);
+      renamed |= names[i] != name;
+    }
+    if (!renamed)
+      return false;
+
+    std::vector<uint8_t> strings(1, 0);
+    std::unordered_map<std::string, uint32_t> offsets;
+    auto add = [&](const std::string &name) -> uint32_t {
+      if (name.empty())
+        return 0;
+      auto [it, inserted] = offsets.emplace(name, strings.size());
+      if (inserted) {
+        strings.insert(strings.end(), name.begin(), name.end());
+        strings.push_back(0);
+      }
+      return it->second;
+    };
+
+    auto symbol_entries = symbols;
+    for (std::size_t i = 0; i < symbols.size(); i++)
+      symbol_entries[i].st_name = add(global(symbols[i])
+                                          ? names[i]
+                                          : string(symbols[i].st_name));
+    auto section_entries = sections;
+    if (shares_names)
+      for (auto &[offset, section] : section_entries)
+        section.sh_name = add(string(section.sh_name));
+
+    auto &table = section_entries[strtab].second;
+    if (strings.size() <= table.sh_size) {
+      std::fill(content.begin() + table.sh_offset,
+                content.begin() + table.sh_offset + table.sh_size, 0);
+    } else {
+      table.sh_offset = content.size();
+      content.resize(content.size() + strings.size());
+    }
+    table.sh_size = strings.size();
+    std::copy(strings.begin(), strings.end(),
+              content.begin() + table.sh_offset);
+
+    for (const auto &[offset, section] : section_entries)
+      std::memcpy(content.data() + offset, &section, sizeof(section));
+    const auto &symbol_table = sections[symtab].second;
+    for (std::size_t i = 0; i < symbol_entries.size(); i++)
+      std::memcpy(content.data() + symbol_table.sh_offset + i * sizeof(Sym),
+                  &symbol_entries[i], sizeof(Sym));
+    return true;
+  }
+
+  const uint8_t *data;
+  std::size_t size;
+  std::vector<std::pair<uint64_t, Shdr>> sections;
+  std::vector<Sym> symbols;
+  std::size_t symtab = 0, strtab = 0, section_names = 0;
+  bool shares_names = false;
+};
+
+// Calls func with the symbol table of an object of the host's byte order
+template <typename Func>
+auto with_symbol_table(const uint8_t *data, std::size_t size, Func func) {
+  if (size < elf::ident_size ||
+      std::memcmp(data, elf::magic, sizeof(elf::magic)) != 0)
+    throw std::logic_error("not an ELF object");
+  // Headers are read as they are, so only the host's byte order is supported
+  if (data[elf::data_offset] != elf::host_data)
+    throw std::logic_error("unsupported byte order");
+  if (data[elf::class_offset] == elf::class64)
+    return func(Symbol_table<elf::Types64>(data, size));
+  if (data[elf::class_offset] == elf::class32)
+    return func(Symbol_table<elf::Types32>(data, size));
+  throw std::logic_error("unsupported ELF class");
+}
+
+std::vector<Static_symbol> read_static_symbols(const uint8_t *data,
+                                               std::size_t size) {
+  if (!is_relocatable(data, size))
+    throw std::logic_error("not a relocatable object");
+  return with_symbol_table(data, size,
+                           [](const auto &table) { return table.read(); });
+}
+
+// Renames the global symbols of a relocatable object in place, returning
+// whether any name changed
+template <typename Rename>
+bool rename_static_symbols(std::vector<uint8_t> &content,
+                           const Rename &rename) {
+  if (!is_relocatable(content))
+    throw std::logic_error("not a relocatable object");
+  // The table points into the original content, which renaming may resize
+  auto original = content;
+  return with_symbol_table(
+      original.data(), original.size(),
+      [&](const auto &table) { return table.rename(content, rename); });
+}
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_RELOCATABLE_H_
@@ -0,0 +1,451 @@
+/* search.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_SEARCH_H_
+#define SYMBOL_SLASHER_SEARCH_H_
+
+#include "output.h"
+#include "pool.h"
+#include "store.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <regex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+
+// An index of every stored name, kept next to the store as <store>.search.
+// Each symbol's mangled and demangled forms are broken into trigrams, and each
+// trigram lists the symbols containing it, so a query only checks the symbols
+// that contain every trigram of the text it requires.  The index is rebuilt
+// whenever the store changes.
+
+namespace slasher {
+
+namespace search {
+
+constexpr char magic[8] = {'S', 'S', 'S', 'E', 'A', 'R', 'C', '1'};
+
+struct Header {
+  char magic[8];
+  // Identifies the version of the store the index was built from
+  uint64_t store_size;
+  int64_t store_mtime;
+  uint64_t entries;
+  uint64_t trigrams;
+  uint64_t postings;
+  uint64_t text_size;
+  uint64_t prefixes_size;
+};
+
+// A stored symbol: its name and demangled form (empty if it does not
+// demangle) are adjacent in the text, separated by a newline
+struct Entry {
+  uint64_t offset;
+  uint32_t name_size;
+  uint32_t demangled_size;
+  uint64_t hash;
+  uint32_t prefix;
+  uint32_t reserved;
+};
+
+// The symbols containing a trigram are postings [start, start + count)
+struct Trigram {
+  uint32_t trigram;
+  uint32_t count;
+  uint64_t start;
+};
+
+uint32_t trigram(const char *text) {
+  return uint32_t(uint8_t(text[0])) << 16 | uint32_t(uint8_t(text[1])) << 8 |
+         uint8_t(text[2]);
+}
+
+// Literal runs that every match of a regular expression must contain.  Only
+// plain characters outside of groups are collected, and nothing is required
+// of an expression with alternatives.
+std::vector<std::string> required_literals(const std::string &pattern) {
+  std::vector<std::string> literals;
+  if (pattern.find('|') != std::string::npos)
+    return literals;
+  std::string run;
+  auto end_run = [&]() {
+    if (run.size() >= 3)
+      literals.push_back(run);
+    run.clear();
+  };
+  // The index of the ] closing a class opened at i.  As in ECMAScript, []
+  // and [^] are whole classes, so the first ] that is not escaped closes it.
+  auto class_end = [&](std::size_t i) {
+    auto close = i + 1;
+    if (close < pattern.size() && pattern[close] == '^')
+      close++;
+    while (close < pattern.size() && pattern[close] != ']')
+      close += pattern[close] == '\\' ? 2 : 1;
+    return std::min(close, pattern.size());
+  };
+  int depth = 0;
+  for (std::size_t i = 0; i < pattern.size(); i++) {
+    auto c = pattern[i];
+    if (depth > 0 || c == '(' || c == ')') {
+      // Groups may be optional or repeated, and a class may hold parentheses
+      end_run();
+      if (c == '\\')
+        i++;
+      else if (c == '[')
+        i = class_end(i);
+      else if (c == '(')
+        depth++;
+      else if (c == ')')
+        depth = std::max(depth - 1, 0);
+    } else if (c == '*' || c == '?' || c == '{') {
+      // The character before may be absent
+      if (!run.empty())
+        run.pop_back();
+      end_run();
+      if (c == '{')
+        i = std::min(pattern.find('}', i), pattern.size());
+    } else if (c == '+') {
+      end_run();
+    } else if (c == '\\' && i + 1 < pattern.size()) {
+      auto escaped = pattern[++i];
+      if (std::isalnum(static_cast<unsigned char>(escaped))) {
+        end_run();
+        // Skip what escapes such as \x41 and \u0041 take after them
+        if (escaped == 'x')
+          i += 2;
+        else if (escaped == 'u')
+          i += 4;
+        else if (escaped == 'c')
+          i += 1;
+        else if (std::isdigit(static_cast<unsigned char>(escaped)))
+          while (i + 1 < pattern.size() &&
+                 std::isdigit(static_cast<unsigned char>(pattern[i + 1])))
+            i++;
+      } else {
+        run += escaped;
+      }
+    } else if (c == '[') {
+      end_run();
+      i = class_end(i);
+    } else if (std::strchr(".^$", c)) {
+      end_run();
+    } else {
+      run += c;
+    }
+  }
+  end_run();
+  return literals;
+}
+
+// Collects every stored symbol, in partition order and then by hash
+struct Symbols : public Store_base {
+  Symbols() : Store_base(true) { seed_demangler = true; }
+
+  struct Symbol {
+    uint32_t prefix;
+    uint64_t hash;
+    std::string name;
+  };
+
+  std::vector<std::string> prefix_list;
+  std::vector<Symbol> symbols;
+  using Store_base::demangler;
+
+private:
+  void insert(const std::string &partition, const json &symbol) override {
+    auto partition_prefix = prefixes.at(partition);
+    auto it = std::find(prefix_list.begin(), prefix_list.end(),
+                        partition_prefix);
+    if (it == prefix_list.end())
+      it = prefix_list.insert(it, partition_prefix);
+    symbols.push_back({uint32_t(it - prefix_list.begin()),
+                       symbol["hash"].get<uint64_t>(), symbol["name"]});
+  }
+};
+
+} // namespace search
+
+struct Search_index {
+  // A symbol that matched a query
+  struct Match {
+    std::string hashed;
+    uint64_t hash;
+    std::string_view name;
+    std::string_view demangled;
+  };
+
+  // Opens the index of a store, building it first if it is missing or the
+  // store changed since it was built
+  Search_index(const std::filesystem::path &store_path, unsigned jobs)
+      : jobs(jobs) {
+    struct stat info;
+    if (::stat(store_path.c_str(), &info) != 0)
+      throw std::logic_error("failed to open hash store");
+    auto index_path = store_path;
+    index_path += ".search";
+    if (!map(index_path, info)) {
+      build(store_path, index_path, info);
+      if (!map(index_path, info))
+        throw std::logic_error("Could not read " + index_path.string());
+    }
+  }
+
+  Search_index(const Search_index &) = delete;
+
+  ~Search_index() {
+    if (data)
+      ::munmap(const_cast<uint8_t *>(data), size);
+  }
+
+  // Symbols whose name or demangled form contains text, or matches a
+  // regular expression, in index order
+  std::vector<Match> find(const std::string &query, bool regex) const {
+    std::vector<std::string> literals;
+    if (regex)
+      literals = search::required_literals(query);
+    else if (query.size() >= 3)
+      literals.push_back(query);
+    auto candidates = this->candidates(literals);
+
+    std::regex pattern;
+    if (regex)
+      pattern = std::regex(query, std::regex::optimize);
+    std::vector<char> matched(candidates.size(), false);
+    parallel_for(candidates.size(), jobs, [&](std::size_t i) {
+      const auto &entry = entries[candidates[i]];
+      std::string_view name(text + entry.offset, entry.name_size);
+      std::string_view demangled(text + entry.offset + entry.name_size + 1,
+                                 entry.demangled_size);
+      auto contains = [&](std::string_view field) {
+        if (!regex)
+          return field.find(query) != std::string_view::npos;
+        return std::regex_search(field.begin(), field.end(), pattern);
+      };
+      matched[i] = contains(name) || contains(demangled);
+    });
+
+    std::vector<Match> matches;
+    for (std::size_t i = 0; i < candidates.size(); i++) {
+      if (!matched[i])
+        continue;
+      const auto &entry = entries[candidates[i]];
+      matches.push_back(
+          {prefixes[entry.prefix] + std::to_string(entry.hash), entry.hash,
+           std::string_view(text + entry.offset, entry.name_size),
+           std::string_view(text + entry.offset + entry.name_size + 1,
+                            entry.demangled_size)});
+    }
+    return matches;
+  }
+
+private:
+  // Symbols containing every trigram of every literal, or every symbol if
+  // there are none to go by
+  std::vector<uint32_t> candidates(const std::vector<std::string> &literals) const {
+    std::vector<const search::Trigram *> lists;
+    for (const auto &literal : literals) {
+      for (std::size_t i = 0; i + 3 <= literal.size(); i++) {
+        auto key = search::trigram(literal.data() + i);
+        auto it = std::lower_bound(
+            trigrams, trigrams + header.trigrams, key,
+            [](const auto &entry, uint32_t key) { return entry.trigram < key; });
+        if (it == trigrams + header.trigrams || it->trigram != key)
+          return {};
+        lists.push_back(it);
+      }
+    }
+
+    std::vector<uint32_t> result;
+    if (lists.empty()) {
+      result.resize(header.entries);
+      for (uint32_t i = 0; i < header.entries; i++)
+        result[i] = i;
+      return result;
+    }
+    // Intersecting from the rarest trigram keeps the candidates few
+    std::sort(lists.begin(), lists.end(),
+              [](const auto *a, const auto *b) { return a->count < b->count; });
+    result.assign(postings + lists[0]->start,
+                  postings + lists[0]->start + lists[0]->count);
+    for (std::size_t i = 1; i < lists.size() && !result.empty(); i++) {
+      const auto *begin = postings + lists[i]->start;
+      std::vector<uint32_t> common;
+      std::set_intersection(result.begin(), result.end(), begin,
+                            begin + lists[i]->count,
+                            std::back_inserter(common));
+      result = std::move(common);
+    }
+    return result;
+  }
+
+  // Maps an index file, returning false if it is missing or out of date
+  bool map(const std::filesystem::path &index_path, const struct stat &store) {
+    File file(::open(index_path.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat info;
+    if (file.fd < 0 || ::fstat(file.fd, &info) != 0 ||
+        std::size_t(info.st_size) < sizeof(search::Header))
+      return false;
+    size = info.st_size;
+    auto mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+    if (mapping == MAP_FAILED)
+      return false;
+    data = static_cast<const uint8_t *>(mapping);
+    std::memcpy(&header, data, sizeof(header));
+    auto expected = sizeof(header) + header.entries * sizeof(search::Entry) +
+                    header.trigrams * sizeof(search::Trigram) +
+                    header.postings * sizeof(uint32_t) + header.text_size +
+                    header.prefixes_size;
+    if (std::memcmp(header.magic, search::magic, sizeof(search::magic)) != 0 ||
+        header.store_size != uint64_t(store.st_size) ||
+        header.store_mtime != mtime(store) || expected != size) {
+      ::munmap(mapping, size);
+      data = nullptr;
+      return false;
+    }
+
+    auto offset = sizeof(header);
+    entries = reinterpret_cast<const search::Entry *>(data + offset);
+    offset += header.entries * sizeof(search::Entry);
+    trigrams = reinterpret_cast<const search::Trigram *>(data + offset);
+    offset += header.trigrams * sizeof(search::Trigram);
+    postings = reinterpret_cast<const uint32_t *>(data + offset);
+    offset += header.postings * sizeof(uint32_t);
+    text = reinterpret_cast<const char *>(data + offset);
+    offset += header.text_size;
+    std::string list(reinterpret_cast<const char *>(data + offset),
+                     header.prefixes_size);
+    prefixes.clear();
+    for (std::size_t start = 0; start < list.size();) {
+      auto end = list.find('\n', start);
+      prefixes.push_back(list.substr(start, end - start));
+      start = end + 1;
+    }
+    return true;
+  }
+
+  void build(const std::filesystem::path &store_path,
+             const std::filesystem::path &index_path, const struct stat &store) {
+    search::Symbols symbols;
+    symbols.open(store_path);
+    std::vector<std::string> names;
+    for (const auto &symbol : symbols.symbols)
+      names.push_back(symbol.name);
+    symbols.demangler.prepare(names, jobs);
+
+    std::string text;
+    std::vector<search::Entry> entries;
+    for (const auto &symbol : symbols.symbols) {
+      auto demangled = symbols.demangler(symbol.name);
+      if (demangled == symbol.name)
+        demangled.clear();
+      entries.push_back({text.size(), uint32_t(symbol.name.size()),
+                         uint32_t(demangled.size()), symbol.hash, symbol.prefix,
+                         0});
+      text += symbol.name + "\n" + demangled + "\n";
+    }
+
+    // Postings are counted for each trigram first, then filled in place, so
+    // they come out sorted by symbol without sorting them
+    std::vector<uint32_t> counts(1 << 24);
+    std::vector<uint32_t> symbol_trigrams;
+    auto for_each_trigram = [&](const search::Entry &entry, auto func) {
+      symbol_trigrams.clear();
+      auto size = entry.name_size + 1 + entry.demangled_size;
+      for (std::size_t i = 0; i + 3 <= size; i++)
+        symbol_trigrams.push_back(search::trigram(&text[entry.offset + i]));
+      std::sort(symbol_trigrams.begin(), symbol_trigrams.end());
+      symbol_trigrams.erase(
+          std::unique(symbol_trigrams.begin(), symbol_trigrams.end()),
+          symbol_trigrams.end());
+      for (auto key : symbol_trigrams)
+        func(key);
+    };
+    for (const auto &entry : entries)
+      for_each_trigram(entry, [&](uint32_t key) { counts[key]++; });
+
+    std::vector<search::Trigram> trigrams;
+    uint64_t total = 0;
+    for (uint32_t key = 0; key < counts.size(); key++) {
+      if (counts[key] == 0)
+        continue;
+      trigrams.push_back({key, counts[key], total});
+      total += counts[key];
+      if (total > UINT32_MAX)
+        throw std::logic_error("too many names to index");
+      // From here on, where the next posting of this trigram goes
+      counts[key] = trigrams.back().start;
+    }
+    std::vector<uint32_t> postings(total);
+    for (uint32_t i = 0; i < entries.size(); i++)
+      for_each_trigram(entries[i],
+                       [&](uint32_t key) { postings[counts[key]++] = i; });
+
+    std::string prefix_list;
+    for (const auto &partition_prefix : symbols.prefix_list)
+      prefix_list += partition_prefix + "\n";
+
+    search::Header header;
+    std::memcpy(header.magic, search::magic, sizeof(search::magic));
+    header.store_size = store.st_size;
+    header.store_mtime = mtime(store);
+    header.entries = entries.size();
+    header.trigrams = trigrams.size();
+    header.postings = postings.size();
+    header.text_size = text.size();
+    header.prefixes_size = prefix_list.size();
+
+    std::vector<uint8_t> content;
+    auto append = [&](const void *data, std::size_t size) {
+      auto bytes = static_cast<const uint8_t *>(data);
+      content.insert(content.end(), bytes, bytes + size);
+    };
+    append(&header, sizeof(header));
+    append(entries.data(), entries.size() * sizeof(search::Entry));
+    append(trigrams.data(), trigrams.size() * sizeof(search::Trigram));
+    append(postings.data(), postings.size() * sizeof(uint32_t));
+    append(text.data(), text.size());
+    append(prefix_list.data(), prefix_list.size());
+    write_file(index_path, content);
+  }
+
+  static int64_t mtime(const struct stat &info) {
+    return int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+  }
+
+  unsigned jobs;
+  const uint8_t *data = nullptr;
+  std::size_t size = 0;
+  search::Header header;
+  const search::Entry *entries = nullptr;
+  const search::Trigram *trigrams = nullptr;
+  const uint32_t *postings = nullptr;
+  const char *text = nullptr;
+  std::vector<std::string> prefixes;
+};
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_SEARCH_H_
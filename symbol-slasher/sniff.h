@@ -0,0 +1,176 @@
+/* sniff.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_SNIFF_H_
+#define SYMBOL_SLASHER_SNIFF_H_
+
+#include "elf_types.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// Reads small parts of ELF files and archives directly, for decisions that
+// should not cost a full parse
+
+namespace slasher {
+
+// Checks the ELF magic and class from the first few bytes of a file
+bool is_elf(const std::filesystem::path &path) {
+  std::ifstream stream(path, std::ios::binary);
+  char ident[5] = {};
+  if (!stream.read(ident, sizeof(ident)))
+    return false;
+  return ident[0] == 0x7f && ident[1] == 'E' && ident[2] == 'L' &&
+         ident[3] == 'F' && (ident[4] == 1 || ident[4] == 2);
+}
+
+constexpr char archive_magic[] = "!<arch>\n";
+constexpr char thin_archive_magic[] = "!<thin>\n";
+constexpr std::size_t archive_magic_size = sizeof(archive_magic) - 1;
+
+// Checks for the magic of a static archive
+bool is_archive(const std::filesystem::path &path) {
+  std::ifstream stream(path, std::ios::binary);
+  char magic[archive_magic_size] = {};
+  return stream.read(magic, sizeof(magic)) &&
+         std::memcmp(magic, archive_magic, sizeof(magic)) == 0;
+}
+
+// Reads the build-id through read(offset, buffer, size), which returns false
+// past the end
+template <typename Types, typename Read>
+std::string find_build_id(const Read &read) {
+  typename Types::Ehdr header;
+  if (!read(0, &header, sizeof(header)))
+    return "";
+  for (unsigned i = 0; i < header.e_phnum; i++) {
+    typename Types::Phdr segment;
+    if (!read(header.e_phoff + i * header.e_phentsize, &segment,
+              sizeof(segment)))
+      return "";
+    if (segment.p_type != elf::pt_note || segment.p_filesz > (1 << 16))
+      continue;
+
+    std::vector<char> notes(segment.p_filesz);
+    if (!read(segment.p_offset, notes.data(), notes.size()))
+      return "";
+    auto align = [](std::size_t size) { return (size + 3) & ~std::size_t(3); };
+    for (std::size_t offset = 0; offset + sizeof(elf::Nhdr) <= notes.size();) {
+      elf::Nhdr note;
+      std::memcpy(&note, notes.data() + offset, sizeof(note));
+      auto name = offset + sizeof(note);
+      auto desc = name + align(note.n_namesz);
+      if (desc + note.n_descsz > notes.size())
+        break;
+      if (note.n_type == elf::nt_gnu_build_id && note.n_namesz == 4 &&
+          std::memcmp(notes.data() + name, "GNU", 4) == 0) {
+        constexpr auto digits = "0123456789abcdef";
+        std::string id;
+        for (std::size_t j = 0; j < note.n_descsz; j++) {
+          auto byte = static_cast<unsigned char>(notes[desc + j]);
+          id += digits[byte >> 4];
+          id += digits[byte & 0xf];
+        }
+        return id;
+      }
+      offset = desc + align(note.n_descsz);
+    }
+  }
+  return "";
+}
+
+template <typename Read> std::string find_build_id(const Read &read) {
+  unsigned char ident[elf::ident_size] = {};
+  if (!read(0, ident, sizeof(ident)) ||
+      std::memcmp(ident, elf::magic, sizeof(elf::magic)) != 0)
+    return "";
+
+  // Headers are read as they are, so only the host's byte order is supported
+  if (ident[elf::data_offset] != elf::host_data)
+    return "";
+  if (ident[elf::class_offset] == elf::class64)
+    return find_build_id<elf::Types64>(read);
+  if (ident[elf::class_offset] == elf::class32)
+    return find_build_id<elf::Types32>(read);
+  return "";
+}
+
+// Reads the GNU build-id from the note segments, or returns an empty string if
+// there is none.  Only the headers and notes are read.
+std::string read_build_id(const std::filesystem::path &path) {
+  std::ifstream stream(path, std::ios::binary);
+  return find_build_id([&](uint64_t offset, void *buffer, std::size_t size) {
+    return bool(stream.seekg(offset) &&
+                stream.read(static_cast<char *>(buffer), size));
+  });
+}
+
+// Reads the GNU build-id of an object already in memory
+std::string read_build_id(const std::vector<uint8_t> &data) {
+  return find_build_id([&](uint64_t offset, void *buffer, std::size_t size) {
+    if (offset > data.size() || data.size() - offset < size)
+      return false;
+    std::memcpy(buffer, data.data() + offset, size);
+    return true;
+  });
+}
+
+template <typename Types> uint64_t read_load_base(std::ifstream &stream) {
+  typename Types::Ehdr header;
+  if (!stream.seekg(0) ||
+      !stream.read(reinterpret_cast<char *>(&header), sizeof(header)))
+    return 0;
+  uint64_t base = UINT64_MAX;
+  for (unsigned i = 0; i < header.e_phnum; i++) {
+    typename Types::Phdr segment;
+    if (!stream.seekg(header.e_phoff + i * header.e_phentsize) ||
+        !stream.read(reinterpret_cast<char *>(&segment), sizeof(segment)))
+      return 0;
+    if (segment.p_type != elf::pt_load)
+      continue;
+    uint64_t align = segment.p_align > 1 ? segment.p_align : 1;
+    base = std::min<uint64_t>(base, segment.p_vaddr & ~(align - 1));
+  }
+  return base == UINT64_MAX ? 0 : base;
+}
+
+// Reads the address an object's first loadable segment is mapped at, which
+// offsets into a loaded module are relative to.  This is zero for shared
+// objects and position independent executables.
+uint64_t read_load_base(const std::filesystem::path &path) {
+  std::ifstream stream(path, std::ios::binary);
+  unsigned char ident[elf::ident_size] = {};
+  if (!stream.read(reinterpret_cast<char *>(ident), sizeof(ident)) ||
+      std::memcmp(ident, elf::magic, sizeof(elf::magic)) != 0 ||
+      ident[elf::data_offset] != elf::host_data)
+    return 0;
+  if (ident[elf::class_offset] == elf::class64)
+    return read_load_base<elf::Types64>(stream);
+  if (ident[elf::class_offset] == elf::class32)
+    return read_load_base<elf::Types32>(stream);
+  return 0;
+}
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_SNIFF_H_
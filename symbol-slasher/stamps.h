@@ -0,0 +1,152 @@
+/* stamps.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_STAMPS_H_
+#define SYMBOL_SLASHER_STAMPS_H_
+
+#include "digest.h"
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <mutex>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Build systems track the store through stamp files, each covering one shard
+// of the names in the store.  A stamp is only rewritten when a name in its
+// shard is inserted or renamed, so an output that depends on the stamps of the
+// names it looks up is not rebuilt for unrelated changes to the store.
+
+namespace slasher {
+
+constexpr unsigned stamp_shards = 4096;
+
+unsigned stamp_shard(const std::string &partition, const std::string &name) {
+  Digest digest;
+  digest.update(partition);
+  digest.update(name);
+  return digest.value().first % stamp_shards;
+}
+
+std::filesystem::path stamp_path(const std::filesystem::path &store_path,
+                                 unsigned shard) {
+  constexpr auto digits = "0123456789abcdef";
+  std::string name = {digits[shard >> 8 & 0xf], digits[shard >> 4 & 0xf],
+                      digits[shard & 0xf]};
+  auto dir = store_path;
+  dir += ".stamps";
+  return dir / name;
+}
+
+// Writes a file unless it already has the given content, so its modification
+// time only changes with its content
+void write_if_changed(const std::filesystem::path &path,
+                      const std::string &content) {
+  std::ifstream existing(path, std::ios::binary);
+  if (existing.is_open() &&
+      std::string(std::istreambuf_iterator<char>(existing), {}) == content)
+    return;
+  std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+  stream << content;
+  if (!stream)
+    throw std::logic_error("Could not write " + path.string());
+}
+
+// Writes the stamp of every shard from the (name, hash) pairs of each
+// partition
+void write_stamps(
+    const std::filesystem::path &store_path,
+    const std::map<std::string, std::unordered_map<std::string, uint64_t>>
+        &partitions) {
+  // Sorted, so each stamp depends only on the contents of its shard
+  std::vector<std::map<std::pair<std::string, std::string>, uint64_t>> shards(
+      stamp_shards);
+  for (const auto &[partition, symbol_map] : partitions)
+    for (const auto &[name, hash] : symbol_map)
+      shards[stamp_shard(partition, name)][{partition, name}] = hash;
+
+  std::filesystem::create_directories(stamp_path(store_path, 0).parent_path());
+  for (unsigned shard = 0; shard < stamp_shards; shard++) {
+    Digest digest;
+    for (const auto &[key, hash] : shards[shard]) {
+      digest.update(key.first);
+      digest.update(key.second);
+      digest.update(&hash, sizeof(hash));
+    }
+    write_if_changed(stamp_path(store_path, shard), digest.hex() + "\n");
+  }
+}
+
+// Records the stamps each output depends on, and writes them as a Makefile
+// style depfile for ninja
+struct Depfile {
+  Depfile(std::filesystem::path depfile_path,
+          std::filesystem::path store_path)
+      : depfile_path(depfile_path), store_path(store_path) {}
+
+  ~Depfile() {
+    std::ofstream stream(depfile_path);
+    for (const auto &[out_path, dependencies] : outputs) {
+      stream << escape(out_path) << ":";
+      for (const auto &dependency : dependencies)
+        stream << " \\\n  " << escape(dependency);
+      stream << "\n";
+    }
+  }
+
+  // Records the stamps of the names an output looked up
+  void record(const std::filesystem::path &out_path,
+              const std::string &partition,
+              const std::vector<std::string> &names) {
+    std::set<unsigned> shards;
+    for (const auto &name : names)
+      shards.insert(stamp_shard(partition, name));
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &dependencies = outputs[out_path.string()];
+    for (auto shard : shards)
+      dependencies.insert(stamp_path(store_path, shard).string());
+  }
+
+private:
+  static std::string escape(const std::string &path) {
+    std::string escaped;
+    for (auto c : path) {
+      if (c == ' ' || c == '#' || c == '\\')
+        escaped += '\\';
+      else if (c == '$')
+        escaped += '$';
+      escaped += c;
+    }
+    return escaped;
+  }
+
+  std::filesystem::path depfile_path;
+  std::filesystem::path store_path;
+  std::map<std::string, std::set<std::string>> outputs;
+  std::mutex mutex;
+};
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_STAMPS_H_
@@ -20,18 +20,51 @@ along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
 #ifndef SYMBOL_SLASHER_STORE_H_
 #define SYMBOL_SLASHER_STORE_H_
 
+#include "archive.h"
+#include "debug.h"
+#include "demangle.h"
+#include "digest.h"
+#include "io.h"
+#include "journal.h"
+#include "output.h"
+#include "pool.h"
+#include "sniff.h"
+#include "stamps.h"
+#include "tar.h"
 #include <LIEF/ELF/Parser.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
 #include <nlohmann/json.hpp>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
 using json = nlohmann::json;
 
 namespace slasher {
 
 constexpr auto prefix = "symslash";
+constexpr auto default_partition = "";
+
+// Prefixes must not end in a digit and must be distinct, so that every hashed
+// name maps back to exactly one partition
+bool valid_prefix(const std::string &partition_prefix) {
+  auto is_word = [](unsigned char c) { return std::isalnum(c) || c == '_'; };
+  return !partition_prefix.empty() && !std::isdigit(partition_prefix.front()) &&
+         !std::isdigit(partition_prefix.back()) &&
+         std::all_of(partition_prefix.begin(), partition_prefix.end(),
+                     [&](unsigned char c) { return is_word(c); });
+}
 
 struct Store_base {
   Store_base(bool read_only) : read_only(read_only) {}
@@ -40,12 +73,23 @@ struct Store_base {
     this->store_path = store_path;
     std::ifstream store_stream(store_path);
 
+    add_partition(default_partition, prefix);
     if (store_stream.is_open() && store_stream.good()) {
       if (store_stream.peek() != std::ifstream::traits_type::eof()) {
         json store;
         store_stream >> store;
+        generation = store.value("generation", uint64_t(0));
+        stamps = store.value("stamps", false);
+        demangled = store.value("demangled", false);
         for (auto &symbol : store["symbols"])
-          insert(symbol["name"], symbol["hash"]);
+          load(default_partition, symbol);
+        for (auto &partition : store["partitions"]) {
+          add_partition(partition["name"], partition["prefix"]);
+          for (auto &symbol : partition["symbols"])
+            load(partition["name"], symbol);
+        }
+        for (auto &object : store["objects"])
+          insert_object(object);
       }
     } else if (read_only) {
       throw std::logic_error("failed to open hash store");
@@ -54,62 +98,268 @@ struct Store_base {
 
   virtual ~Store_base(){};
 
+  // Whether the store keeps stamp files for build systems
+  bool keeps_stamps() const { return stamps; }
+
+  // Whether the store keeps the demangled form of each symbol
+  bool keeps_demangled() const { return demangled; }
+
 protected:
+  void load(const std::string &partition, const json &symbol) {
+    insert(partition, symbol);
+    // Names without a demangled form in such a store do not demangle
+    if (demangled && seed_demangler)
+      demangler.remember(symbol["name"],
+                         symbol.value("demangled", symbol["name"]));
+  }
+
+  void add_partition(std::string partition, std::string partition_prefix) {
+    if (!valid_prefix(partition_prefix))
+      throw std::logic_error("invalid partition prefix: " + partition_prefix);
+    for (const auto &[name, existing] : prefixes)
+      if (name != partition && existing == partition_prefix)
+        throw std::logic_error("partition prefix already in use: " +
+                               partition_prefix);
+    prefixes[partition] = partition_prefix;
+  }
+
   std::filesystem::path store_path;
 
   const bool read_only;
 
+  // Prefix of the hashed names in each partition
+  std::map<std::string, std::string> prefixes;
+
+  // Incremented by every run that changes the store
+  uint64_t generation = 0;
+
+  bool stamps = false;
+
+  bool demangled = false;
+
+  // Shared by every object listed in a run, and seeded from the store where
+  // seed_demangler is set before opening it, by those that demangle names
+  Demangler demangler;
+  bool seed_demangler = false;
+
 private:
-  virtual void insert(std::string name, uint64_t hash){};
+  virtual void insert(const std::string &partition, const json &symbol){};
+  virtual void insert_object(const json &object){};
 };
 
 struct Forward_map : public Store_base {
-  Forward_map(bool read_only) : Store_base(read_only) {}
+  // Writers keep the demangled forms of a store that has them
+  Forward_map(bool read_only) : Store_base(read_only) {
+    seed_demangler = !read_only;
+  }
+
+  ~Forward_map() { flush(); }
 
-  ~Forward_map() {
+  // Writes the store.  Symbols inserted afterwards belong to the next
+  // generation.
+  void flush() {
     // Dump only new hashes
     if (!read_only) {
       std::ofstream store_stream(store_path);
       json store;
-      for (const auto &[name, hash] : symbol_map) {
-        json symbol;
-        symbol["name"] = name;
-        symbol["hash"] = hash;
-        store["symbols"].push_back(symbol);
+      store["generation"] = current_generation();
+      store["symbols"] = json::array();
+      for (const auto &[partition, partition_prefix] : prefixes) {
+        // Sorted by hash, so the same store is always written the same way
+        std::map<uint64_t, std::string> sorted;
+        for (const auto &[name, hash] : partitions[partition])
+          sorted.emplace(hash, name);
+        if (demangled) {
+          std::vector<std::string> names;
+          for (const auto &[hash, name] : sorted)
+            names.push_back(name);
+          demangler.prepare(names, default_jobs());
+        }
+        json symbols = json::array();
+        for (const auto &[hash, name] : sorted) {
+          json symbol;
+          symbol["name"] = name;
+          symbol["hash"] = hash;
+          if (demangled && demangler(name) != name)
+            symbol["demangled"] = demangler(name);
+          auto it = generations[partition].find(name);
+          if (it != generations[partition].end())
+            symbol["generation"] = it->second;
+          symbols.push_back(symbol);
+        }
+        if (partition == default_partition) {
+          store["symbols"] = symbols;
+        } else {
+          json entry;
+          entry["name"] = partition;
+          entry["prefix"] = partition_prefix;
+          entry["symbols"] = symbols;
+          store["partitions"].push_back(entry);
+        }
       }
+      store["objects"] = objects;
+      if (stamps)
+        store["stamps"] = true;
+      if (demangled)
+        store["demangled"] = true;
       store >> store_stream;
+      if (stamps)
+        write_stamps(store_path, partitions);
+      generation = current_generation();
+      changed = false;
+    }
+  }
+
+  // Keeps a stamp file for each shard of the store from now on
+  void keep_stamps() { stamps = true; }
+
+  // Keeps the demangled form of each symbol from now on, so listing does not
+  // need to demangle stored names
+  void keep_demangled() { demangled = true; }
+
+  // Selects the partition that symbols are inserted into and hashed from.
+  // Partitions that do not exist yet are created, unless the store is read-only.
+  void select(std::string partition, std::string partition_prefix = "") {
+    if (prefixes.count(partition) == 0) {
+      if (read_only)
+        throw std::logic_error("unknown partition: " + partition);
+      add_partition(partition, partition_prefix.empty()
+                                   ? std::string(prefix) + partition + "_"
+                                   : partition_prefix);
+    } else if (!partition_prefix.empty() &&
+               prefixes[partition] != partition_prefix) {
+      throw std::logic_error("partition " + partition +
+                             " already uses prefix " + prefixes[partition]);
     }
+    selected = partition;
   }
 
   void insert(std::string name) {
-    if (symbol_map.count(name) == 0)
+    auto &symbol_map = partitions[selected];
+    if (symbol_map.count(name) == 0) {
       symbol_map[name] = symbol_map.size();
+      generations[selected][name] = generation + 1;
+      changed = true;
+    }
   }
 
-  std::string hash(std::string name) {
-    return symbol_map.count(name) == 0
+  // Inserts every symbol defined by an object
+  void insert(LIEF::ELF::Binary &object) {
+    for (auto &symbol : object.dynamic_symbols()) {
+      if (symbol.value() != 0)
+        insert(symbol.name());
+    }
+  }
+
+  std::string hash(std::string name) const {
+    auto partition = partitions.find(selected);
+    if (partition == partitions.end())
+      return name;
+    auto it = partition->second.find(name);
+    return it == partition->second.end()
                ? name
-               : std::string(prefix) + std::to_string(symbol_map[name]);
+               : prefixes.at(selected) + std::to_string(it->second);
+  }
+
+  // Identifies the contents of the selected partition, which is all that
+  // hashing depends on
+  std::string fingerprint() const {
+    Digest digest;
+    digest.update(prefixes.at(selected));
+    auto partition = partitions.find(selected);
+    if (partition != partitions.end()) {
+      std::map<uint64_t, std::string> sorted;
+      for (const auto &[name, hash] : partition->second)
+        sorted.emplace(hash, name);
+      for (const auto &[hash, name] : sorted)
+        digest.update(name);
+    }
+    return digest.hex();
+  }
+
+  // The generation of the store once this run's changes are written
+  uint64_t current_generation() const {
+    return changed ? generation + 1 : generation;
+  }
+
+  // Names in the selected partition that were inserted or renamed after the
+  // given generation
+  std::vector<std::string> changed_since(uint64_t since) const {
+    std::vector<std::string> names;
+    auto partition = generations.find(selected);
+    if (partition != generations.end())
+      for (const auto &[name, name_generation] : partition->second)
+        if (name_generation > since)
+          names.push_back(name);
+    return names;
   }
 
+  // Remembers that an object's symbols were inserted into the selected
+  // partition
+  void inserted(const std::filesystem::path &object_path,
+                const std::string &digest, const std::string &build_id) {
+    json object;
+    object["path"] = object_path.string();
+    object["partition"] = selected;
+    object["digest"] = digest;
+    if (!build_id.empty())
+      object["build_id"] = build_id;
+    insert_object(object);
+    changed = true;
+  }
+
+  bool inserted_digest(const std::string &digest) const {
+    return digests.count(selected + '\0' + digest) != 0;
+  }
+
+  bool inserted_build_id(const std::string &build_id) const {
+    return !build_id.empty() && build_ids.count(selected + '\0' + build_id);
+  }
+
+protected:
+  std::string selected = default_partition;
+  bool changed = false;
+
+  // Each partition has its own dense space of hashes
+  std::map<std::string, std::unordered_map<std::string, uint64_t>> partitions;
+
+  // The generation in which each symbol got its current hash, if not the first
+  std::map<std::string, std::unordered_map<std::string, uint64_t>> generations;
+
 private:
-  void insert(std::string name, uint64_t hash) override {
-    symbol_map[name] = hash;
+  void insert(const std::string &partition, const json &symbol) override {
+    partitions[partition][symbol["name"]] = symbol["hash"];
+    if (symbol.count("generation"))
+      generations[partition][symbol["name"]] = symbol["generation"];
+  }
+
+  void insert_object(const json &object) override {
+    std::string partition = object["partition"];
+    digests.insert(partition + '\0' + object["digest"].get<std::string>());
+    if (object.count("build_id"))
+      build_ids.insert(partition + '\0' +
+                       object["build_id"].get<std::string>());
+    objects.push_back(object);
   }
 
-  std::unordered_map<std::string, uint64_t> symbol_map;
+  // Objects already inserted, keyed by partition and content digest or build-id
+  json objects = json::array();
+  std::unordered_set<std::string> digests;
+  std::unordered_set<std::string> build_ids;
 };
 
 struct Reverse_map : public Store_base {
   Reverse_map() : Store_base(false) {}
 
-  std::string dehash(std::string name) {
-    return symbol_map.count(name) == 0 ? name : symbol_map[name];
+  std::string dehash(std::string name) const {
+    auto it = symbol_map.find(name);
+    return it == symbol_map.end() ? name : it->second;
   }
 
 private:
-  void insert(std::string name, uint64_t hash) override {
-    symbol_map[std::string(prefix) + std::to_string(hash)] = name;
+  void insert(const std::string &partition, const json &symbol) override {
+    symbol_map[prefixes[partition] + std::to_string(uint64_t(symbol["hash"]))] =
+        symbol["name"];
   }
 
   std::unordered_map<std::string, std::string> symbol_map;
@@ -128,105 +378,819 @@ load_binary(std::filesystem::path object_path) {
   return object;
 }
 
+// Parses an object that has already been read into memory
+std::unique_ptr<LIEF::ELF::Binary>
+load_binary(const std::vector<uint8_t> &data,
+            std::filesystem::path object_path) {
+  std::unique_ptr<LIEF::ELF::Binary> object;
+  try {
+    object = LIEF::ELF::Parser::parse(data, object_path.string());
+  } catch (...) {
+    throw std::logic_error("Could not parse object file");
+  }
+  if (!object)
+    throw std::logic_error("Could not parse object file");
+  return object;
+}
+
 void store_binary(std::filesystem::path in_path, std::filesystem::path out_path,
                   std::unique_ptr<LIEF::ELF::Binary> &object) {
+  std::vector<uint8_t> content;
   try {
-    object->write(out_path);
+    content = object->raw();
   } catch (...) {
     throw std::logic_error("Could not open object file for writing");
   }
+  write_patched(in_path, out_path, content);
+}
+
+// Dynamic symbols of an object, split into those it defines (in symbol table
+// order) and those it imports.  For relocatable objects and archives, these
+// are the global symbols of their symbol tables, in member order.
+struct Object_symbols {
+  std::vector<std::string> defined;
+  std::unordered_set<std::string> undefined;
+};
+
+// An undefined function whose address an executable takes keeps a nonzero
+// value (its PLT entry), so only the section index tells definitions apart
+bool is_defined(const LIEF::ELF::Symbol &symbol) {
+  return symbol.shndx() != elf::shn_undef;
+}
+
+// Data that an executable copies out of a shared object is defined in the
+// executable, but still imported from the object that it is copied from
+Object_symbols object_symbols(LIEF::ELF::Binary &object) {
+  Object_symbols symbols;
+  for (auto &symbol : object.dynamic_symbols()) {
+    if (is_defined(symbol))
+      symbols.defined.push_back(symbol.name());
+    else
+      symbols.undefined.insert(symbol.name());
+  }
+  auto copy = elf::copy_relocation(
+      static_cast<uint16_t>(object.header().machine_type()));
+  for (auto &relocation : object.dynamic_relocations())
+    if (copy != 0 && relocation.type() == copy && relocation.has_symbol())
+      symbols.undefined.insert(relocation.symbol().name());
+  return symbols;
+}
+
+// Reads the symbols of an object, or of every object in an archive, with
+// archive members read by up to jobs threads
+Object_symbols object_symbols(const std::vector<uint8_t> &data,
+                              const std::filesystem::path &object_path,
+                              unsigned jobs = 1) {
+  Object_symbols symbols;
+  auto add_static = [&](const std::vector<Static_symbol> &table) {
+    for (const auto &symbol : table) {
+      if (symbol.binding == elf::stb_local)
+        continue;
+      if (symbol.defined)
+        symbols.defined.push_back(symbol.name);
+      else
+        symbols.undefined.insert(symbol.name);
+    }
+  };
+  if (is_archive(data)) {
+    for (const auto &member : read_archive_symbols(data, jobs))
+      add_static(member.second);
+  } else if (is_relocatable(data)) {
+    add_static(read_static_symbols(data.data(), data.size()));
+  } else {
+    symbols = object_symbols(*load_binary(data, object_path));
+  }
+  return symbols;
+}
 
-  // Copy file permissions
-  std::filesystem::permissions(out_path,
-                               std::filesystem::status(in_path).permissions());
+std::vector<Object_symbols>
+read_symbols(const std::vector<std::filesystem::path> &object_paths,
+             unsigned jobs) {
+  std::vector<Object_symbols> objects(object_paths.size());
+  pipeline(object_paths, jobs, [&](std::size_t i, const auto &data) {
+    objects[i] = object_symbols(data, object_paths[i], jobs);
+  });
+  return objects;
 }
 
 struct Inserter : public Forward_map {
   Inserter() : Forward_map(false) {}
 
+  // Inserts only the symbols that are defined in one object of the link set
+  // and imported by another.  Insertion follows the order of the objects and
+  // their symbols, so the ids do not depend on parsing order.
+  void link_set(const std::vector<std::filesystem::path> &object_paths,
+                unsigned jobs) {
+    auto objects = read_symbols(object_paths, jobs);
+    std::unordered_map<std::string, std::size_t> importers;
+    for (const auto &object : objects)
+      for (const auto &name : object.undefined)
+        importers[name]++;
+    for (const auto &object : objects) {
+      for (const auto &name : object.defined) {
+        auto it = importers.find(name);
+        if (it != importers.end() &&
+            it->second > object.undefined.count(name))
+          insert(name);
+      }
+    }
+  }
+
   void operator()(std::filesystem::path object_path) {
-    auto object = load_binary(object_path);
-    auto symbols = object->dynamic_symbols();
-    for (auto &symbol : symbols) {
-      if (symbol.value() != 0)
-        insert(symbol.name());
+    for (const auto &name :
+         object_symbols(read_file(object_path), object_path).defined)
+      insert(name);
+  }
+
+  // Parses the objects concurrently, then inserts their symbols in input
+  // order, so the ids match those of inserting each object in turn.  Objects
+  // whose content was already inserted are skipped without parsing, and when
+  // build-ids are trusted, only the build-id is read.
+  void operator()(const std::vector<std::filesystem::path> &object_paths,
+                  unsigned jobs, bool trust_build_id = false) {
+    std::vector<std::string> digests(object_paths.size());
+    std::vector<std::string> build_ids(object_paths.size());
+    std::vector<char> skip(object_paths.size(), false);
+    parallel_for(object_paths.size(), jobs, [&](std::size_t i) {
+      build_ids[i] = read_build_id(object_paths[i]);
+      if (trust_build_id && inserted_build_id(build_ids[i])) {
+        skip[i] = true;
+        return;
+      }
+      digests[i] = digest_file(object_paths[i]);
+      skip[i] = inserted_digest(digests[i]);
+    });
+
+    std::vector<std::filesystem::path> changed_paths;
+    for (std::size_t i = 0; i < object_paths.size(); i++)
+      if (!skip[i])
+        changed_paths.push_back(object_paths[i]);
+    auto objects = read_symbols(changed_paths, jobs);
+    for (std::size_t i = 0, j = 0; i < object_paths.size(); i++) {
+      if (skip[i])
+        continue;
+      for (const auto &name : objects[j++].defined)
+        insert(name);
+      inserted(object_paths[i], digests[i], build_ids[i]);
     }
   }
+
+  // Inserts every symbol defined by the objects in a tar stream, in stream
+  // order, returning nonzero if any object could not be read
+  int tar(const std::filesystem::path &tar_path, unsigned jobs) {
+    auto fd = open_tar(tar_path);
+    File file(is_stdio(tar_path) ? -1 : fd);
+    return for_each_tar_entry<Object_symbols>(
+        fd, jobs,
+        [&](Tar_entry &entry, Object_symbols &symbols) {
+          symbols = object_symbols(entry.content, entry.name, jobs);
+        },
+        [&](Tar_entry &, Object_symbols *symbols) {
+          if (symbols)
+            for (const auto &name : symbols->defined)
+              insert(name);
+        });
+  }
 };
 
 struct Hasher : public Forward_map {
-  Hasher(bool keep_static) : Forward_map(true), keep_static(keep_static) {}
+  Hasher(bool keep_static, bool read_only = true)
+      : Forward_map(read_only), keep_static(keep_static) {}
+
+  // Hides stored symbols that are exported but not imported by any object in
+  // the link set, rather than hashing them
+  void prune(const std::vector<std::filesystem::path> &link_set,
+             unsigned jobs) {
+    pruning = true;
+    for (auto &object : read_symbols(link_set, jobs))
+      imported.insert(object.undefined.begin(), object.undefined.end());
+  }
+
+  // Moves the symbol table of each output, with global names hashed, to a
+  // debug file at the path that debug_path gives for the output (none where it
+  // is empty), and links the output to it.  With debug_sections, the .debug_*
+  // sections move there too.
+  void split_debug(
+      std::function<std::filesystem::path(const std::filesystem::path &)>
+          debug_path,
+      bool debug_sections) {
+    this->debug_path = debug_path;
+    this->debug_sections = debug_sections;
+  }
 
   void operator()(std::filesystem::path in_path,
-                  std::filesystem::path out_path) {
-    auto object = load_binary(in_path);
-    for (auto &symbol : object->dynamic_symbols())
-      symbol.name(hash(symbol.name()));
+                  std::filesystem::path out_path) const {
+    (*this)(in_path, out_path, read_file(in_path));
+  }
+
+  // Hashes an object that has already been read, and returns the names it
+  // looked up if they are tracked.  Relocatable objects and archives have
+  // their symbol tables rewritten directly, and are neither pruned nor
+  // stripped, since their symbol table is what a static link resolves
+  // against.
+  std::vector<std::string> operator()(std::filesystem::path in_path,
+                                      std::filesystem::path out_path,
+                                      const std::vector<uint8_t> &data) const {
+    if (!is_static(data)) {
+      auto object = load_binary(data, in_path);
+      return (*this)(in_path, out_path, object, &data);
+    }
+    if (debug_path && !debug_path(out_path).empty())
+      throw std::logic_error(
+          "debug files are only split from linked objects");
+    std::mutex mutex;
+    std::vector<std::string> names;
+    auto content = data;
+    rename_static(content, jobs, [&](const std::string &name) {
+      if (tracking()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        names.push_back(name);
+      }
+      return hash(name);
+    });
+    write_patched(in_path, out_path, content);
+    record(in_path, out_path, names, {});
+    return names;
+  }
+
+  // Hashes an object that has already been parsed, from data if it was read.
+  // Only reads the store, so several objects may be hashed concurrently.
+  std::vector<std::string>
+  operator()(std::filesystem::path in_path, std::filesystem::path out_path,
+             std::unique_ptr<LIEF::ELF::Binary> &object,
+             const std::vector<uint8_t> *data = nullptr) const {
+    // Output to standard output must stay a clean object
+    auto names = rename(*object, in_path.string(),
+                        is_stdio(out_path) ? std::cerr : std::cout);
+    auto debug = debug_path ? debug_path(out_path) : std::filesystem::path();
+    if (!debug.empty())
+      write_debug(debug, *object, data ? *data : read_file(in_path), names);
     if (!keep_static)
       object->remove(object->static_symbols_section(), true);
     store_binary(in_path, out_path, object);
+    record(in_path, out_path, names, debug);
+    return names;
+  }
+
+  // Records an output that was placed from a cache, given the names it looked
+  // up when it was hashed
+  void record_cached(const std::filesystem::path &in_path,
+                     const std::filesystem::path &out_path,
+                     const std::vector<std::string> &names) const {
+    record(in_path, out_path, names, {});
+  }
+
+  // Hashes an object held in memory, such as a member of a tar stream, and
+  // returns its new content.  Nothing is recorded for it, and pruning is
+  // reported on stderr, where it cannot mix with a stream on stdout.
+  std::vector<uint8_t> rewrite(const std::string &name,
+                               const std::vector<uint8_t> &data) const {
+    auto content = data;
+    if (is_static(data)) {
+      rename_static(content, jobs,
+                    [&](const std::string &symbol) { return hash(symbol); });
+      return content;
+    }
+    auto object = load_binary(data, name);
+    rename(*object, name, std::cerr);
+    if (!keep_static)
+      object->remove(object->static_symbols_section(), true);
+    try {
+      return object->raw();
+    } catch (...) {
+      throw std::logic_error("Could not open object file for writing");
+    }
+  }
+
+  // Records each output in a journal, for rehashing it when names it looked up
+  // change
+  void record(Journal &journal) { this->journal = &journal; }
+
+  // Records the stamps of the names each output looked up in a depfile
+  void depend(Depfile &depfile) { this->depfile = &depfile; }
+
+  // Identifies everything the output depends on besides the input
+  std::string fingerprint() const {
+    Digest digest;
+    digest.update(Forward_map::fingerprint());
+    digest.update(keep_static ? "keep-static" : "strip-static");
+    if (debug_path)
+      digest.update(debug_sections ? "split-debug-sections" : "split-debug");
+    if (pruning) {
+      std::vector<std::string> sorted(imported.begin(), imported.end());
+      std::sort(sorted.begin(), sorted.end());
+      for (const auto &name : sorted)
+        digest.update(name);
+    }
+    return digest.hex();
   }
 
+  // Threads for the members of each archive
+  unsigned jobs = 1;
+
+  // Whether the names each output looks up are needed
+  bool tracking() const { return journal || depfile; }
+
 private:
+  // Hashes the dynamic symbols of an object, or hides them when pruning, and
+  // returns the names looked up if they are tracked
+  std::vector<std::string> rename(LIEF::ELF::Binary &object,
+                                  const std::string &name,
+                                  std::ostream &report) const {
+    uint64_t pruned = 0, saved = 0;
+    std::vector<std::string> names;
+    // Only shared objects export symbols for others to resolve
+    bool prunable =
+        pruning && object.header().file_type() == LIEF::ELF::E_TYPE::ET_DYN;
+    for (auto &symbol : object.dynamic_symbols()) {
+      if (tracking())
+        names.push_back(symbol.name());
+      auto hashed = hash(symbol.name());
+      if (prunable && hashed != symbol.name() && is_defined(symbol) &&
+          symbol.binding() != LIEF::ELF::SYMBOL_BINDINGS::STB_LOCAL &&
+          imported.count(symbol.name()) == 0) {
+        // Hidden symbols are resolved within the object without a lookup, so
+        // they no longer need a name.  The binding is kept, since locals must
+        // come before every global in the table.
+        symbol.visibility(LIEF::ELF::ELF_SYMBOL_VISIBILITY::STV_HIDDEN);
+        symbol.name("");
+        pruned++;
+        saved += hashed.size() + 1;
+      } else {
+        symbol.name(hashed);
+      }
+    }
+    if (pruning) {
+      // Formatted up front so that concurrent reports do not interleave
+      report << name + ": pruned " + std::to_string(pruned) +
+                    " exports, saving " + std::to_string(saved) +
+                    " bytes of symbol names\n"
+             << std::flush;
+    }
+    return names;
+  }
+
+  // Writes the debug file of an object and links the object to it.  Names
+  // looked up for the debug file are added to names.
+  void write_debug(const std::filesystem::path &debug,
+                   LIEF::ELF::Binary &object, const std::vector<uint8_t> &data,
+                   std::vector<std::string> &names) const {
+    auto content = debug_file(
+        data,
+        [&](const std::string &name) {
+          if (tracking())
+            names.push_back(name);
+          return hash(name);
+        },
+        debug_sections);
+    if (debug.has_parent_path())
+      std::filesystem::create_directories(debug.parent_path());
+    write_file(debug, content);
+
+    std::vector<std::string> removed;
+    for (auto &section : object.sections())
+      if ((debug_sections && is_debug_section(section.name())) ||
+          section.name() == ".gnu_debuglink")
+        removed.push_back(section.name());
+    for (const auto &name : removed)
+      object.remove(object.get_section(name), true);
+    LIEF::ELF::Section link(".gnu_debuglink",
+                            LIEF::ELF::ELF_SECTION_TYPES::SHT_PROGBITS);
+    link.content(debuglink(debug, content));
+    link.alignment(4);
+    object.add(link, false);
+  }
+
+  void record(const std::filesystem::path &in_path,
+              const std::filesystem::path &out_path,
+              const std::vector<std::string> &names,
+              const std::filesystem::path &debug) const {
+    if (depfile)
+      depfile->record(out_path, selected, names);
+    if (!journal)
+      return;
+    Bloom lookups(names.size());
+    for (const auto &name : names)
+      lookups.add(name);
+    json entry;
+    entry["input"] = std::filesystem::absolute(in_path).string();
+    entry["partition"] = selected;
+    entry["keep_static"] = keep_static;
+    entry["pruned"] = pruning;
+    entry["generation"] = current_generation();
+    entry["names"] = lookups.hex();
+    if (!debug.empty()) {
+      entry["debug"] = std::filesystem::absolute(debug).string();
+      entry["debug_sections"] = debug_sections;
+    }
+    journal->record(std::filesystem::absolute(out_path), entry);
+  }
+
   bool keep_static;
+  bool pruning = false;
+  std::unordered_set<std::string> imported;
+  std::function<std::filesystem::path(const std::filesystem::path &)>
+      debug_path;
+  bool debug_sections = false;
+  Journal *journal = nullptr;
+  Depfile *depfile = nullptr;
+};
+
+struct Renumberer : public Forward_map {
+  Renumberer() : Forward_map(false) {}
+
+  // Counts the references (undefined imports) to stored symbols
+  void operator()(std::filesystem::path object_path) {
+    auto symbols = object_symbols(read_file(object_path), object_path);
+    auto &names = object_names[object_path.string()];
+    for (const auto &name : symbols.defined)
+      if (stored(name))
+        names.push_back(name);
+    for (const auto &name : symbols.undefined) {
+      if (!stored(name))
+        continue;
+      names.push_back(name);
+      references[name]++;
+    }
+  }
+
+  // Reassigns ids in every partition so the most referenced symbols get the
+  // shortest names, and returns the plan of renamed symbols and objects that
+  // must be rehashed
+  json renumber() {
+    json plan;
+    plan["renamed"] = json::array();
+    plan["rehash"] = json::array();
+    std::unordered_set<std::string> renamed;
+    for (auto &[partition, symbol_map] : partitions) {
+      std::vector<std::pair<std::string, uint64_t>> order(symbol_map.begin(),
+                                                          symbol_map.end());
+      std::sort(order.begin(), order.end(), [&](const auto &a, const auto &b) {
+        auto a_refs = count(a.first), b_refs = count(b.first);
+        return a_refs != b_refs ? a_refs > b_refs : a.second < b.second;
+      });
+
+      const auto &partition_prefix = prefixes[partition];
+      for (uint64_t id = 0; id < order.size(); id++) {
+        const auto &[name, old_id] = order[id];
+        if (old_id == id)
+          continue;
+        json entry;
+        entry["name"] = name;
+        entry["from"] = partition_prefix + std::to_string(old_id);
+        entry["to"] = partition_prefix + std::to_string(id);
+        plan["renamed"].push_back(entry);
+        symbol_map[name] = id;
+        generations[partition][name] = generation + 1;
+        changed = true;
+        renamed.insert(name);
+      }
+    }
+
+    // Objects are listed in sorted order so that plans are reproducible
+    std::map<std::string, bool> affected;
+    for (const auto &[path, names] : object_names)
+      affected[path] =
+          std::any_of(names.begin(), names.end(),
+                      [&](const auto &name) { return renamed.count(name); });
+    for (const auto &[path, rehash] : affected)
+      if (rehash)
+        plan["rehash"].push_back(path);
+    return plan;
+  }
+
+private:
+  bool stored(const std::string &name) const {
+    return std::any_of(partitions.begin(), partitions.end(),
+                       [&](const auto &p) { return p.second.count(name); });
+  }
+
+  uint64_t count(const std::string &name) const {
+    auto it = references.find(name);
+    return it == references.end() ? 0 : it->second;
+  }
+
+  std::unordered_map<std::string, uint64_t> references;
+  std::unordered_map<std::string, std::vector<std::string>> object_names;
 };
 
 struct Dehasher : public Reverse_map {
   void operator()(std::filesystem::path in_path,
-                  std::filesystem::path out_path) {
-    auto object = load_binary(in_path);
+                  std::filesystem::path out_path) const {
+    (*this)(in_path, out_path, read_file(in_path));
+  }
+
+  void operator()(std::filesystem::path in_path, std::filesystem::path out_path,
+                  const std::vector<uint8_t> &data) const {
+    if (!is_static(data)) {
+      auto object = load_binary(data, in_path);
+      (*this)(in_path, out_path, object);
+      return;
+    }
+    auto content = data;
+    rename_static(content, jobs,
+                  [&](const std::string &name) { return dehash(name); });
+    write_patched(in_path, out_path, content);
+  }
+
+  void operator()(std::filesystem::path in_path, std::filesystem::path out_path,
+                  std::unique_ptr<LIEF::ELF::Binary> &object) const {
     auto symbols = object->dynamic_symbols();
     for (auto &symbol : symbols)
       symbol.name(dehash(symbol.name()));
     store_binary(in_path, out_path, object);
   }
+
+  // Dehashes an object held in memory and returns its new content
+  std::vector<uint8_t> rewrite(const std::string &name,
+                               const std::vector<uint8_t> &data) const {
+    auto content = data;
+    if (is_static(data)) {
+      rename_static(content, jobs,
+                    [&](const std::string &symbol) { return dehash(symbol); });
+      return content;
+    }
+    auto object = load_binary(data, name);
+    for (auto &symbol : object->dynamic_symbols())
+      symbol.name(dehash(symbol.name()));
+    try {
+      return object->raw();
+    } catch (...) {
+      throw std::logic_error("Could not open object file for writing");
+    }
+  }
+
+  // Threads for the members of each archive
+  unsigned jobs = 1;
 };
 
 struct Lister : public Reverse_map {
-  Lister(bool demangle) : demangle(demangle) {}
+  enum Format { text, json, csv, tsv };
 
-  void operator()(std::filesystem::path object_path) {
-    auto object = load_binary(object_path);
-    auto symbols = object->dynamic_symbols();
-    for (auto &symbol : symbols) {
-      if (symbol.value() == 0) {
-        std::cout << "                ";
+  Lister(bool demangle, Format format = text)
+      : demangle(demangle), format(format) {
+    seed_demangler = demangle;
+  }
+
+  // Lists the dynamic symbols of a linked object, or the symbol table of a
+  // relocatable object or of each object in an archive.  Listings are
+  // formatted into large buffers and written in the order of the objects,
+  // while objects are read and formatted concurrently.  Objects that cannot
+  // be read are reported and skipped; returns nonzero if there were any.
+  int operator()(const std::vector<std::filesystem::path> &object_paths,
+                 unsigned jobs, std::ostream &stream) {
+    std::mutex mutex;
+    std::vector<std::string> listings(object_paths.size());
+    std::vector<char> done(object_paths.size(), false);
+    std::size_t next = 0;
+    std::atomic<std::size_t> failed(0);
+    auto finish = [&](std::size_t i, std::string listing) {
+      std::lock_guard<std::mutex> lock(mutex);
+      listings[i] = std::move(listing);
+      done[i] = true;
+      for (; next < object_paths.size() && done[next]; next++) {
+        write(stream, listings[next]);
+        std::string().swap(listings[next]);
+      }
+    };
+    auto report = [&](std::size_t i, const std::string &error) {
+      std::cerr << "Error: " + object_paths[i].string() + ": " + error + "\n";
+      failed++;
+      finish(i, "");
+    };
+    begin(stream);
+    pipeline(
+        object_paths, jobs,
+        [&](std::size_t i, const auto &data) {
+          std::string listing;
+          try {
+            (*this)(data, object_paths[i].string(), object_paths.size() > 1,
+                    jobs, listing);
+          } catch (const std::exception &e) {
+            report(i, e.what());
+            return;
+          }
+          finish(i, std::move(listing));
+        },
+        report);
+    end(stream);
+    return failed == 0 ? 0 : 1;
+  }
+
+  // Lists the objects in tar streams, in stream order, returning nonzero if
+  // any object could not be read
+  int tar(const std::vector<std::filesystem::path> &tar_paths, unsigned jobs,
+          std::ostream &stream) {
+    int result = 0;
+    begin(stream);
+    for (const auto &tar_path : tar_paths) {
+      auto fd = open_tar(tar_path);
+      File file(is_stdio(tar_path) ? -1 : fd);
+      result |= for_each_tar_entry<std::string>(
+          fd, jobs,
+          [&](Tar_entry &entry, std::string &listing) {
+            (*this)(entry.content, entry.name, true, jobs, listing);
+          },
+          [&](Tar_entry &, std::string *listing) {
+            if (listing)
+              write(stream, *listing);
+          });
+    }
+    end(stream);
+    return result;
+  }
+
+  // Formats the listing of one object, introduced by its name in the text
+  // format if header is set, with archive members read by up to jobs
+  // threads.  Only reads the store, so several objects may be formatted
+  // concurrently.
+  void operator()(const std::vector<uint8_t> &data,
+                  const std::string &object_name, bool header, unsigned jobs,
+                  std::string &out) const {
+    // Symbols of each archive member, or of the object itself
+    std::vector<std::pair<std::string, std::vector<Static_symbol>>> members;
+    if (is_archive(data)) {
+      members = read_archive_symbols(data, jobs);
+    } else if (is_relocatable(data)) {
+      members.emplace_back("", read_static_symbols(data.data(), data.size()));
+    } else {
+      auto object = load_binary(data, object_name);
+      members.emplace_back("", std::vector<Static_symbol>());
+      for (auto &symbol : object->dynamic_symbols())
+        members.back().second.push_back(
+            {symbol.name(), symbol.value(),
+             static_cast<unsigned char>(symbol.binding()),
+             symbol.value() != 0});
+    }
+
+    if (header && format == text)
+      out += "\n" + object_name + ":\n";
+    for (const auto &[member, symbols] : members) {
+      if (!member.empty() && format == text)
+        out += "\n" + member + ":\n";
+      for (const auto &symbol : symbols)
+        print(out, object_name, member, symbol.value, symbol.defined,
+              symbol.binding, symbol.name);
+    }
+  }
+
+private:
+  // What goes before the first listing, such as the header of a table
+  void begin(std::ostream &stream) {
+    wrote = false;
+    if (format == csv)
+      stream << "object,member,defined,value,binding,name,hashed\n";
+    if (format == tsv)
+      stream << "object\tmember\tdefined\tvalue\tbinding\tname\thashed\n";
+  }
+
+  void write(std::ostream &stream, const std::string &listing) {
+    if (listing.empty())
+      return;
+    // Records are separated within a listing, and listings here
+    if (format == json)
+      stream << (wrote ? ",\n" : "[\n");
+    stream.write(listing.data(), listing.size());
+    wrote = true;
+  }
+
+  void end(std::ostream &stream) {
+    if (format == json)
+      stream << (wrote ? "\n]\n" : "[]\n");
+    stream.flush();
+  }
+
+  void print(std::string &out, const std::string &object_name,
+             const std::string &member, uint64_t value, bool defined,
+             unsigned binding, const std::string &name) const {
+    const char *binding_name = binding == elf::stb_local    ? "local"
+                               : binding == elf::stb_global ? "global"
+                               : binding == elf::stb_weak   ? "weak"
+                                                            : "other";
+    auto dehashed = dehash(name);
+    auto shown = demangle ? demangler(dehashed) : dehashed;
+    auto hashed = dehashed != name ? name : std::string();
+
+    switch (format) {
+    case text:
+      if (defined)
+        append_hex(out, value);
+      else
+        out.append(16, ' ');
+      out += ' ';
+      out += binding_name;
+      out.append(7 - std::strlen(binding_name), ' ');
+      out += hashed.empty() ? "    " : "(#) " + hashed + " -> ";
+      out += shown;
+      out += '\n';
+      break;
+    case json:
+      if (!out.empty())
+        out += ",\n";
+      out += "  {\"object\": ";
+      append_json(out, object_name);
+      if (!member.empty()) {
+        out += ", \"member\": ";
+        append_json(out, member);
+      }
+      out += defined ? ", \"defined\": true" : ", \"defined\": false";
+      out += ", \"value\": \"";
+      append_hex(out, value);
+      out += "\", \"binding\": \"";
+      out += binding_name;
+      out += "\", \"name\": ";
+      append_json(out, shown);
+      if (!hashed.empty()) {
+        out += ", \"hashed\": ";
+        append_json(out, hashed);
+      }
+      out += '}';
+      break;
+    case csv:
+    case tsv: {
+      auto separator = format == csv ? ',' : '\t';
+      append_field(out, object_name);
+      out += separator;
+      append_field(out, member);
+      out += separator;
+      out += defined ? "true" : "false";
+      out += separator;
+      if (defined)
+        append_hex(out, value);
+      out += separator;
+      out += binding_name;
+      out += separator;
+      append_field(out, shown);
+      out += separator;
+      append_field(out, hashed);
+      out += '\n';
+      break;
+    }
+    }
+  }
+
+  static void append_hex(std::string &out, uint64_t value) {
+    constexpr auto digits = "0123456789abcdef";
+    char buffer[16];
+    for (int i = 15; i >= 0; i--, value >>= 4)
+      buffer[i] = digits[value & 0xf];
+    out.append(buffer, sizeof(buffer));
+  }
+
+  static void append_json(std::string &out, const std::string &value) {
+    out += '"';
+    for (unsigned char c : value) {
+      if (c == '"' || c == '\\') {
+        out += '\\';
+        out += c;
+      } else if (c < 0x20) {
+        out += "\\u00";
+        out += "0123456789abcdef"[c >> 4];
+        out += "0123456789abcdef"[c & 0xf];
       } else {
-        std::ios_base::fmtflags f(std::cout.flags());
-        std::cout << std::hex << std::setfill('0') << std::setw(16)
-                  << symbol.value();
-        std::cout.flags(f);
+        out += c;
+      }
+    }
+    out += '"';
+  }
+
+  // CSV quotes fields that need it, and TSV escapes tabs and newlines
+  void append_field(std::string &out, const std::string &value) const {
+    if (format == csv) {
+      if (value.find_first_of(",\"\n\r") == std::string::npos) {
+        out += value;
+        return;
+      }
+      out += '"';
+      for (auto c : value) {
+        if (c == '"')
+          out += '"';
+        out += c;
       }
-      std::cout << " ";
-      switch (symbol.binding()) {
-      case LIEF::ELF::SYMBOL_BINDINGS::STB_LOCAL:
-        std::cout << "local ";
+      out += '"';
+      return;
+    }
+    for (auto c : value) {
+      switch (c) {
+      case '\t':
+        out += "\\t";
         break;
-      case LIEF::ELF::SYMBOL_BINDINGS::STB_GLOBAL:
-        std::cout << "global";
+      case '\n':
+        out += "\\n";
         break;
-      case LIEF::ELF::SYMBOL_BINDINGS::STB_WEAK:
-        std::cout << "weak  ";
+      case '\\':
+        out += "\\\\";
         break;
       default:
-        std::cout << "other ";
-        break;
+        out += c;
       }
-      std::cout << " ";
-      auto dehashed = dehash(symbol.name());
-      if (dehashed != symbol.name()) {
-        std::cout << "(#) " << symbol.name() << " -> ";
-        symbol.name(dehashed);
-      } else {
-        std::cout << "    ";
-      }
-      std::cout << (demangle ? symbol.demangled_name() : symbol.name());
-      std::cout << std::endl;
     }
   }
 
-private:
   bool demangle;
+  Format format;
+  // Whether a listing was written, for separating the records of JSON
+  bool wrote = false;
 };
 
 } // namespace slasher
@@ -0,0 +1,273 @@
+/* symbolize.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_SYMBOLIZE_H_
+#define SYMBOL_SLASHER_SYMBOLIZE_H_
+
+#include "output.h"
+#include "sniff.h"
+#include "store.h"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unordered_map>
+#include <vector>
+
+// Indexes of the addresses covered by the dynamic symbols of hashed modules,
+// kept in a cache directory as <build-id>.index.  Each index holds the
+// original names, sorted by address, so an offset into a module can be
+// symbolized by binary search without the module or the store.  A module is
+// indexed again when it is added after the store changed.
+
+namespace slasher {
+
+namespace symbolize {
+
+constexpr char magic[8] = {'S', 'S', 'S', 'Y', 'M', 'B', 'L', '2'};
+
+struct Header {
+  char magic[8];
+  // Identifies the version of the store the names were read from
+  uint64_t store_size;
+  int64_t store_mtime;
+  uint64_t ranges;
+  uint64_t text_size;
+};
+
+// A symbol covering [start, start + size), relative to the module's load
+// address, whose name is text [offset, offset + name_size)
+struct Range {
+  uint64_t start;
+  uint64_t size;
+  uint64_t offset;
+  uint32_t name_size;
+  uint32_t reserved;
+};
+
+struct Symbol {
+  uint64_t start;
+  uint64_t size;
+  std::string name;
+};
+
+// Build-ids are used in paths, so only hex digits are accepted
+bool valid_build_id(const std::string &build_id) {
+  return !build_id.empty() &&
+         std::all_of(build_id.begin(), build_id.end(), [](char c) {
+           return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f');
+         });
+}
+
+int64_t mtime(const struct stat &info) {
+  return int64_t(info.st_mtim.tv_sec) * 1000000000 + info.st_mtim.tv_nsec;
+}
+
+// Whether an index exists and was built from this version of the store
+bool built_from(const std::filesystem::path &index_path,
+                const struct stat &store) {
+  File file(::open(index_path.c_str(), O_RDONLY | O_CLOEXEC));
+  Header header;
+  return file.fd >= 0 &&
+         ::pread(file.fd, &header, sizeof(header), 0) == sizeof(header) &&
+         std::memcmp(header.magic, magic, sizeof(magic)) == 0 &&
+         header.store_size == uint64_t(store.st_size) &&
+         header.store_mtime == mtime(store);
+}
+
+// Lays out an index.  Of the symbols starting at the same address (such as
+// aliases), only the largest is kept.
+std::vector<uint8_t> index_content(std::vector<Symbol> symbols,
+                                   const struct stat &store) {
+  std::sort(symbols.begin(), symbols.end(), [](const auto &a, const auto &b) {
+    if (a.start != b.start)
+      return a.start < b.start;
+    if (a.size != b.size)
+      return a.size > b.size;
+    return a.name < b.name;
+  });
+  symbols.erase(std::unique(symbols.begin(), symbols.end(),
+                            [](const auto &a, const auto &b) {
+                              return a.start == b.start;
+                            }),
+                symbols.end());
+
+  std::vector<Range> ranges;
+  std::string text;
+  for (const auto &symbol : symbols) {
+    ranges.push_back({symbol.start, symbol.size, text.size(),
+                      uint32_t(symbol.name.size()), 0});
+    text += symbol.name;
+  }
+
+  Header header;
+  std::memcpy(header.magic, magic, sizeof(magic));
+  header.store_size = store.st_size;
+  header.store_mtime = mtime(store);
+  header.ranges = ranges.size();
+  header.text_size = text.size();
+
+  std::vector<uint8_t> content;
+  auto append = [&](const void *data, std::size_t size) {
+    auto bytes = static_cast<const uint8_t *>(data);
+    content.insert(content.end(), bytes, bytes + size);
+  };
+  append(&header, sizeof(header));
+  append(ranges.data(), ranges.size() * sizeof(Range));
+  append(text.data(), text.size());
+  return content;
+}
+
+} // namespace symbolize
+
+// A mapped index of one module
+struct Symbol_index {
+  // The symbol an address falls in, and how far into it
+  struct Location {
+    std::string_view name;
+    uint64_t offset;
+  };
+
+  // Maps an index, throwing if it is not a valid one
+  Symbol_index(const std::filesystem::path &index_path) {
+    File file(::open(index_path.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat info;
+    if (file.fd < 0 || ::fstat(file.fd, &info) != 0 ||
+        std::size_t(info.st_size) < sizeof(symbolize::Header))
+      throw std::logic_error("Could not read " + index_path.string());
+    size = info.st_size;
+    auto mapping = ::mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+    if (mapping == MAP_FAILED)
+      throw std::logic_error("Could not read " + index_path.string());
+    data = static_cast<const uint8_t *>(mapping);
+    std::memcpy(&header, data, sizeof(header));
+    if (std::memcmp(header.magic, symbolize::magic, sizeof(symbolize::magic)) !=
+            0 ||
+        sizeof(header) + header.ranges * sizeof(symbolize::Range) +
+                header.text_size !=
+            size) {
+      ::munmap(mapping, size);
+      throw std::logic_error("Invalid symbol index " + index_path.string());
+    }
+    ranges = reinterpret_cast<const symbolize::Range *>(data + sizeof(header));
+    text = reinterpret_cast<const char *>(ranges + header.ranges);
+  }
+
+  Symbol_index(const Symbol_index &) = delete;
+
+  ~Symbol_index() { ::munmap(const_cast<uint8_t *>(data), size); }
+
+  // Finds the symbol covering an address.  Symbols without a size only cover
+  // their own address.
+  std::optional<Location> find(uint64_t address) const {
+    auto end = ranges + header.ranges;
+    auto it = std::upper_bound(
+        ranges, end, address,
+        [](uint64_t address, const auto &range) { return address < range.start; });
+    if (it == ranges)
+      return std::nullopt;
+    --it;
+    auto offset = address - it->start;
+    if (offset >= std::max<uint64_t>(it->size, 1))
+      return std::nullopt;
+    return Location{std::string_view(text + it->offset, it->name_size), offset};
+  }
+
+private:
+  const uint8_t *data = nullptr;
+  std::size_t size = 0;
+  symbolize::Header header;
+  const symbolize::Range *ranges = nullptr;
+  const char *text = nullptr;
+};
+
+struct Symbolizer {
+  Symbolizer(std::filesystem::path store_path, std::filesystem::path cache_dir)
+      : store_path(store_path), cache_dir(cache_dir) {}
+
+  // Indexes a module, unless a module with the same build-id already was
+  // since the store last changed.  Returns the build-id.
+  std::string add(const std::filesystem::path &module_path) {
+    auto build_id = read_build_id(module_path);
+    if (!symbolize::valid_build_id(build_id))
+      throw std::logic_error(module_path.string() + " has no build-id");
+    struct stat store;
+    if (::stat(store_path.c_str(), &store) != 0)
+      throw std::logic_error("failed to open hash store");
+    auto index_path = path(build_id);
+    if (symbolize::built_from(index_path, store))
+      return build_id;
+
+    // The store is only read once a module needs indexing
+    if (!reverse_map) {
+      reverse_map = std::make_unique<Reverse_map>();
+      reverse_map->open(store_path);
+    }
+    auto object = load_binary(module_path);
+    auto base = read_load_base(module_path);
+    // Only functions and data defined in the module, leaving out imports
+    // whose value is a PLT entry
+    std::vector<symbolize::Symbol> symbols;
+    for (auto &symbol : object->dynamic_symbols()) {
+      auto type = symbol.type();
+      if (is_defined(symbol) && symbol.value() >= base &&
+          (type == LIEF::ELF::ELF_SYMBOL_TYPES::STT_FUNC ||
+           type == LIEF::ELF::ELF_SYMBOL_TYPES::STT_OBJECT))
+        symbols.push_back({symbol.value() - base, symbol.size(),
+                           reverse_map->dehash(symbol.name())});
+    }
+    std::filesystem::create_directories(cache_dir);
+    write_file(index_path,
+               symbolize::index_content(std::move(symbols), store));
+    return build_id;
+  }
+
+  // The index of a module, or nullptr if it was never indexed
+  const Symbol_index *index(const std::string &build_id) {
+    auto it = indexes.find(build_id);
+    if (it != indexes.end())
+      return it->second.get();
+    std::unique_ptr<Symbol_index> index;
+    if (symbolize::valid_build_id(build_id) &&
+        std::filesystem::exists(path(build_id)))
+      index = std::make_unique<Symbol_index>(path(build_id));
+    return (indexes[build_id] = std::move(index)).get();
+  }
+
+private:
+  std::filesystem::path path(const std::string &build_id) const {
+    return cache_dir / (build_id + ".index");
+  }
+
+  std::filesystem::path store_path;
+  std::filesystem::path cache_dir;
+  std::unique_ptr<Reverse_map> reverse_map;
+  std::unordered_map<std::string, std::unique_ptr<Symbol_index>> indexes;
+};
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_SYMBOLIZE_H_
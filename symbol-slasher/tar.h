@@ -0,0 +1,546 @@
+/* tar.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_TAR_H_
+#define SYMBOL_SLASHER_TAR_H_
+
+#include "io.h"
+#include "output.h"
+#include "sniff.h"
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Tar streams in the ustar format, with the pax and GNU extensions for long
+// names and large sizes.  Streams are read and written one entry at a time,
+// so a layer or package is never unpacked to disk.
+
+namespace slasher {
+
+constexpr std::size_t tar_block = 512;
+using Tar_header = std::array<uint8_t, tar_block>;
+
+// A file in a tar stream, along with the extension headers that precede it
+struct Tar_entry {
+  // GNU long name and long link headers, with their content, as they were read
+  std::vector<uint8_t> extensions;
+  // The pax header of this entry, its content and its records, if it has one
+  bool has_pax = false;
+  Tar_header pax_header;
+  std::vector<uint8_t> pax_content;
+  std::vector<std::pair<std::string, std::string>> pax;
+
+  Tar_header header;
+  std::string name;
+  char type;
+  // The size recorded in the headers, which content no longer matches once
+  // it is rewritten
+  uint64_t size;
+  std::vector<uint8_t> content;
+
+  // Whether the content is that of a regular file
+  bool regular() const { return type == '0' || type == '\0' || type == '7'; }
+
+  // Whether the content is an ELF object or a static archive
+  bool object() const {
+    if (!regular())
+      return false;
+    if (content.size() >= sizeof(elf::magic) &&
+        std::memcmp(content.data(), elf::magic, sizeof(elf::magic)) == 0)
+      return true;
+    return content.size() >= archive_magic_size &&
+           std::memcmp(content.data(), archive_magic, archive_magic_size) == 0;
+  }
+};
+
+namespace tar {
+
+constexpr std::size_t name_field = 0, name_width = 100;
+constexpr std::size_t size_field = 124, size_width = 12;
+constexpr std::size_t checksum_field = 148, checksum_width = 8;
+constexpr std::size_t type_field = 156;
+constexpr std::size_t magic_field = 257;
+constexpr std::size_t prefix_field = 345, prefix_width = 155;
+
+std::string field(const Tar_header &header, std::size_t offset,
+                  std::size_t width) {
+  auto begin = reinterpret_cast<const char *>(&header[offset]);
+  return std::string(begin, strnlen(begin, width));
+}
+
+// Numbers are octal text, or big-endian binary where the top bit is set
+uint64_t number(const Tar_header &header, std::size_t offset,
+                std::size_t width) {
+  uint64_t value = 0;
+  if (header[offset] & 0x80) {
+    for (std::size_t i = 1; i < width; i++)
+      value = value << 8 | header[offset + i];
+    return value;
+  }
+  for (std::size_t i = offset; i < offset + width; i++) {
+    if (header[i] == ' ' && value == 0)
+      continue;
+    if (header[i] < '0' || header[i] > '7')
+      break;
+    value = value << 3 | (header[i] - '0');
+  }
+  return value;
+}
+
+void put_number(Tar_header &header, std::size_t offset, std::size_t width,
+                uint64_t value) {
+  if (value >> (3 * (width - 1)) == 0) {
+    header[offset + width - 1] = 0;
+    for (std::size_t i = width - 1; i-- > 0; value >>= 3)
+      header[offset + i] = '0' + (value & 7);
+    return;
+  }
+  header[offset] = 0x80;
+  for (std::size_t i = width; i-- > 1; value >>= 8)
+    header[offset + i] = uint8_t(value);
+}
+
+void put_checksum(Tar_header &header) {
+  std::memset(&header[checksum_field], ' ', checksum_width);
+  unsigned sum = 0;
+  for (auto byte : header)
+    sum += byte;
+  put_number(header, checksum_field, checksum_width - 1, sum);
+  header[checksum_field + checksum_width - 1] = ' ';
+}
+
+bool zero(const Tar_header &header) {
+  for (auto byte : header)
+    if (byte != 0)
+      return false;
+  return true;
+}
+
+std::size_t padded(std::size_t size) {
+  return (size + tar_block - 1) / tar_block * tar_block;
+}
+
+// Records of a pax header, each "<length> <key>=<value>\n", where the length
+// counts the whole record
+std::vector<std::pair<std::string, std::string>>
+read_pax(const std::vector<uint8_t> &content) {
+  std::vector<std::pair<std::string, std::string>> records;
+  std::string text(content.begin(), content.end());
+  for (std::size_t offset = 0; offset < text.size();) {
+    auto space = text.find(' ', offset);
+    if (space == std::string::npos)
+      break;
+    auto length = std::stoull(text.substr(offset, space - offset));
+    if (length < space - offset + 2 || offset + length > text.size())
+      throw std::logic_error("bad pax header record");
+    auto record = text.substr(space + 1, offset + length - space - 2);
+    auto equals = record.find('=');
+    if (equals == std::string::npos)
+      throw std::logic_error("bad pax header record");
+    records.emplace_back(record.substr(0, equals), record.substr(equals + 1));
+    offset += length;
+  }
+  return records;
+}
+
+std::string write_pax(
+    const std::vector<std::pair<std::string, std::string>> &records) {
+  std::string text;
+  for (const auto &[key, value] : records) {
+    auto body = " " + key + "=" + value + "\n";
+    // The length includes its own digits
+    auto length = body.size() + 1;
+    while (std::to_string(length).size() + body.size() != length)
+      length++;
+    text += std::to_string(length) + body;
+  }
+  return text;
+}
+
+} // namespace tar
+
+// Reads entries from a tar stream in order
+struct Tar_reader {
+  explicit Tar_reader(int fd) : fd(fd) {}
+
+  // Reads the next entry, returning false at the end of the stream
+  bool next(Tar_entry &entry) {
+    entry = Tar_entry();
+    std::string long_name;
+    for (;;) {
+      if (!read(entry.header.data(), tar_block, true) || tar::zero(entry.header))
+        return false;
+      auto type = char(entry.header[tar::type_field]);
+      auto size = tar::number(entry.header, tar::size_field, tar::size_width);
+      // A pax size record covers sizes that do not fit the header
+      bool extension = type == 'L' || type == 'K' || type == 'x';
+      for (const auto &[key, value] : entry.pax)
+        if (key == "size" && !extension)
+          size = std::stoull(value);
+      std::vector<uint8_t> content(size);
+      read(content.data(), size, false);
+      skip(tar::padded(size) - size);
+
+      if (type == 'L' || type == 'K') {
+        if (type == 'L')
+          long_name.assign(content.begin(),
+                           std::find(content.begin(), content.end(), 0));
+        entry.extensions.insert(entry.extensions.end(), entry.header.begin(),
+                                entry.header.end());
+        entry.extensions.insert(entry.extensions.end(), content.begin(),
+                                content.end());
+        entry.extensions.resize(tar::padded(entry.extensions.size()));
+        continue;
+      }
+      if (type == 'x') {
+        entry.has_pax = true;
+        entry.pax_header = entry.header;
+        entry.pax = tar::read_pax(content);
+        entry.pax_content = std::move(content);
+        continue;
+      }
+
+      entry.type = type;
+      entry.size = size;
+      entry.content = std::move(content);
+      for (const auto &[key, value] : entry.pax)
+        if (key == "path")
+          long_name = value;
+      if (!long_name.empty()) {
+        entry.name = long_name;
+      } else {
+        entry.name = tar::field(entry.header, tar::name_field, tar::name_width);
+        auto prefix =
+            tar::field(entry.header, tar::prefix_field, tar::prefix_width);
+        // The prefix field only holds a prefix in POSIX ustar headers
+        if (std::memcmp(&entry.header[tar::magic_field], "ustar", 6) == 0 &&
+            !prefix.empty())
+          entry.name = prefix + "/" + entry.name;
+      }
+      return true;
+    }
+  }
+
+private:
+  bool read(uint8_t *data, std::size_t size, bool at_end_ok) {
+    for (std::size_t done = 0; done < size;) {
+      auto count = ::read(fd, data + done, size - done);
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count < 0)
+        throw std::logic_error("Could not read tar stream");
+      if (count == 0) {
+        if (done == 0 && at_end_ok)
+          return false;
+        throw std::logic_error("truncated tar stream");
+      }
+      done += count;
+    }
+    return true;
+  }
+
+  void skip(std::size_t size) {
+    uint8_t padding[tar_block];
+    read(padding, size, false);
+  }
+
+  int fd;
+};
+
+// Writes entries to a tar stream, updating the recorded size of any entry
+// whose content changed
+struct Tar_writer {
+  explicit Tar_writer(int fd) : fd(fd) {}
+
+  // Headers are copied as they were read unless the size changed.  Sizes past
+  // the octal field are written in binary, as GNU tar does.
+  void write(Tar_entry &entry) {
+    put(entry.extensions.data(), entry.extensions.size());
+    auto size = entry.content.size();
+    bool resized = size != entry.size;
+    if (entry.has_pax) {
+      bool pax_size = false;
+      for (auto &[key, value] : entry.pax) {
+        if (key == "size" && resized) {
+          value = std::to_string(size);
+          pax_size = true;
+        }
+      }
+      if (pax_size) {
+        auto text = tar::write_pax(entry.pax);
+        entry.pax_content.assign(text.begin(), text.end());
+        tar::put_number(entry.pax_header, tar::size_field, tar::size_width,
+                        text.size());
+        tar::put_checksum(entry.pax_header);
+      }
+      put(entry.pax_header.data(), tar_block);
+      put(entry.pax_content.data(), entry.pax_content.size());
+      pad(entry.pax_content.size());
+    }
+    if (resized) {
+      tar::put_number(entry.header, tar::size_field, tar::size_width, size);
+      tar::put_checksum(entry.header);
+      entry.size = size;
+    }
+    put(entry.header.data(), tar_block);
+    put(entry.content.data(), size);
+    pad(size);
+  }
+
+  // Ends the stream with two empty blocks, padded to a whole record as tar
+  // itself does
+  void finish() {
+    constexpr std::size_t record = 20 * tar_block;
+    std::vector<uint8_t> end(2 * tar_block);
+    end.resize(2 * tar_block + (record - (written + end.size()) % record) %
+                                   record);
+    put(end.data(), end.size());
+  }
+
+private:
+  void put(const uint8_t *data, std::size_t size) {
+    for (std::size_t done = 0; done < size;) {
+      auto count = ::write(fd, data + done, size - done);
+      if (count < 0 && errno == EINTR)
+        continue;
+      if (count <= 0)
+        throw std::logic_error("Could not write tar stream");
+      done += count;
+    }
+    written += size;
+  }
+
+  void pad(std::size_t size) {
+    static const uint8_t zeros[tar_block] = {};
+    put(zeros, tar::padded(size) - size);
+  }
+
+  int fd;
+  uint64_t written = 0;
+};
+
+// Reads a tar stream and calls process(entry, result) for every object in it
+// on up to jobs threads, then emit(entry, result) for every entry in stream
+// order on a single thread, where result is null for entries that are not
+// objects or failed to process.  At most max_in_flight() bytes of entries are
+// held between reading and emitting (a single larger entry is still taken on
+// its own).  Errors are reported per object and do not stop the others;
+// returns nonzero if any object failed.
+template <typename Result, typename Process, typename Emit>
+int for_each_tar_entry(int fd, unsigned jobs, Process process, Emit emit) {
+  struct Slot {
+    Tar_entry entry;
+    Result result;
+    bool object = false;
+    bool done = false;
+    bool failed = false;
+  };
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::deque<std::shared_ptr<Slot>> window, pending;
+  std::size_t in_flight = 0;
+  bool reading = true, stopping = false;
+  std::exception_ptr error;
+  std::size_t failed = 0;
+
+  auto worker = [&]() {
+    for (;;) {
+      std::shared_ptr<Slot> slot;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() {
+          return stopping || !pending.empty() || !reading;
+        });
+        if (stopping || pending.empty())
+          return;
+        slot = pending.front();
+        pending.pop_front();
+      }
+      bool ok = true;
+      try {
+        Stage_timer timer(io_stats().process, slot->entry.content.size());
+        process(slot->entry, slot->result);
+      } catch (const std::exception &e) {
+        std::cerr << "Error: " + slot->entry.name + ": " + e.what() + "\n";
+        ok = false;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      slot->failed = !ok;
+      failed += !ok;
+      slot->done = true;
+      changed.notify_all();
+    }
+  };
+
+  auto writer = [&]() {
+    for (;;) {
+      std::shared_ptr<Slot> slot;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        changed.wait(lock, [&]() {
+          return stopping || (!window.empty() && window.front()->done) ||
+                 (window.empty() && !reading);
+        });
+        if (stopping || window.empty())
+          return;
+        slot = window.front();
+      }
+      try {
+        emit(slot->entry,
+             slot->object && !slot->failed ? &slot->result : nullptr);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!error)
+          error = std::current_exception();
+        stopping = true;
+        changed.notify_all();
+        return;
+      }
+      std::lock_guard<std::mutex> lock(mutex);
+      in_flight -= slot->entry.content.size();
+      window.pop_front();
+      changed.notify_all();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (unsigned i = 0; i < std::max(1u, jobs); i++)
+    threads.emplace_back(worker);
+  threads.emplace_back(writer);
+
+  try {
+    Tar_reader reader(fd);
+    for (;;) {
+      auto slot = std::make_shared<Slot>();
+      {
+        Stage_timer timer(io_stats().read);
+        if (!reader.next(slot->entry))
+          break;
+        io_stats().read.bytes += slot->entry.content.size();
+      }
+      slot->object = slot->entry.object();
+      slot->done = !slot->object;
+      auto size = slot->entry.content.size();
+      std::unique_lock<std::mutex> lock(mutex);
+      changed.wait(lock, [&]() {
+        return stopping || window.empty() ||
+               in_flight + size <= max_in_flight();
+      });
+      if (stopping)
+        break;
+      in_flight += size;
+      window.push_back(slot);
+      if (slot->object)
+        pending.push_back(slot);
+      changed.notify_all();
+    }
+  } catch (...) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!error)
+      error = std::current_exception();
+    stopping = true;
+  }
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    reading = false;
+    changed.notify_all();
+  }
+  for (auto &thread : threads)
+    thread.join();
+  if (error)
+    std::rethrow_exception(error);
+  return failed == 0 ? 0 : 1;
+}
+
+// Opens a tar stream for reading, where "-" is standard input
+int open_tar(const std::filesystem::path &path) {
+  if (is_stdio(path))
+    return STDIN_FILENO;
+  auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw std::logic_error("Could not open " + path.string());
+  return fd;
+}
+
+// Rewrites every object in a tar stream with rewrite(name, content), which
+// returns the new content, and copies every other entry as it is
+template <typename Rewrite>
+int rewrite_tar(int in_fd, int out_fd, unsigned jobs, const Rewrite &rewrite) {
+  Tar_writer writer(out_fd);
+  auto result = for_each_tar_entry<std::vector<uint8_t>>(
+      in_fd, jobs,
+      [&](Tar_entry &entry, std::vector<uint8_t> &content) {
+        content = rewrite(entry.name, entry.content);
+      },
+      [&](Tar_entry &entry, std::vector<uint8_t> *content) {
+        if (content)
+          entry.content = std::move(*content);
+        Stage_timer timer(io_stats().write, entry.content.size());
+        writer.write(entry);
+      });
+  writer.finish();
+  return result;
+}
+
+// Rewrites the tar stream at in_path into out_path, either of which may be
+// "-".  The new stream is assembled next to out_path and renamed into place
+// once it is complete.
+template <typename Rewrite>
+int rewrite_tar(const std::filesystem::path &in_path,
+                const std::filesystem::path &out_path, unsigned jobs,
+                const Rewrite &rewrite) {
+  auto in_fd = open_tar(in_path);
+  File in(is_stdio(in_path) ? -1 : in_fd);
+  if (is_stdio(out_path))
+    return rewrite_tar(in_fd, STDOUT_FILENO, jobs, rewrite);
+  File out(-1);
+  auto temp_path = temp_file(out_path, out);
+  try {
+    auto result = rewrite_tar(in_fd, out.fd, jobs, rewrite);
+    if (::fchmod(out.fd, 0644) != 0 || ::fsync(out.fd) != 0)
+      throw std::logic_error("Could not write " + out_path.string());
+    std::filesystem::rename(temp_path, out_path);
+    return result;
+  } catch (...) {
+    ::unlink(temp_path.c_str());
+    throw;
+  }
+}
+
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_TAR_H_
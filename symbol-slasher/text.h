@@ -0,0 +1,215 @@
+/* text.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_TEXT_H_
+#define SYMBOL_SLASHER_TEXT_H_
+
+#include "io.h"
+#include "output.h"
+#include "store.h"
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+// Dehashes names in text, such as logs, stack traces and profiler output.  A
+// hashed name is a partition prefix followed by decimal digits, standing on
+// its own rather than inside a longer identifier.  Hashes in a partition are
+// dense, so the name is found by indexing rather than a lookup by string.
+
+namespace slasher {
+
+struct Text_dehasher : public Store_base {
+  Text_dehasher(bool demangle) : Store_base(true), demangle(demangle) {
+    seed_demangler = demangle;
+  }
+
+  // Copies text from one file descriptor to another, dehashing it on the way.
+  // Text is streamed in large blocks, and a word cut off at the end of a
+  // block is carried into the next one.
+  void operator()(int in, int out) {
+    constexpr std::size_t block = 1 << 20;
+    // Words longer than this are cut rather than carried
+    constexpr std::size_t max_carry = 1 << 12;
+    std::vector<char> buffer(block + max_carry);
+    std::size_t carried = 0;
+    bool word_before = false;
+    std::string output;
+    output.reserve(2 * block);
+    for (;;) {
+      auto size = ::read(in, buffer.data() + carried, block);
+      if (size < 0 && errno == EINTR)
+        continue;
+      if (size < 0)
+        throw std::logic_error("Could not read text");
+      auto begin = buffer.data(), end = begin + carried + size;
+      // Hold back a trailing word that the next block may continue, even
+      // if it is all there is, as reads from a pipe can end mid-word
+      auto stop = end;
+      if (size > 0) {
+        while (stop > begin && word[uint8_t(stop[-1])])
+          stop--;
+        if (std::size_t(end - stop) > max_carry)
+          stop = end;
+      }
+      replace(begin, stop, word_before, output);
+      if (stop > begin)
+        word_before = word[uint8_t(stop[-1])];
+      if (output.size() >= block || size == 0) {
+        write_all(out, output.data(), output.size());
+        output.clear();
+      }
+      if (size == 0)
+        return;
+      carried = end - stop;
+      std::memmove(buffer.data(), stop, carried);
+    }
+  }
+
+private:
+  struct Partition {
+    std::string prefix;
+    // Names by hash, with demangled forms filled in as they are first needed
+    std::vector<std::string> names;
+    std::vector<std::string> demangled;
+  };
+
+  void insert(const std::string &partition, const json &symbol) override {
+    auto &names = partition_named(partition).names;
+    uint64_t hash = symbol["hash"];
+    if (hash >= names.size())
+      names.resize(hash + 1);
+    names[hash] = symbol["name"];
+  }
+
+  Partition &partition_named(const std::string &partition) {
+    const auto &partition_prefix = prefixes.at(partition);
+    for (auto &existing : partitions)
+      if (existing.prefix == partition_prefix)
+        return existing;
+    partitions.push_back({partition_prefix, {}, {}});
+    auto first = uint8_t(partition_prefix[0]);
+    if (!starts[first]) {
+      starts[first] = true;
+      firsts.push_back(char(first));
+    }
+    return partitions.back();
+  }
+
+  // Appends text to output with every hashed name replaced
+  void replace(const char *begin, const char *end, bool word_before,
+               std::string &output) {
+    auto copied = begin;
+    for (auto p = find_start(begin, end); p; p = find_start(p + 1, end)) {
+      if (p > begin ? word[uint8_t(p[-1])] : word_before)
+        continue;
+      for (auto &partition : partitions) {
+        const auto &partition_prefix = partition.prefix;
+        if (std::size_t(end - p) <= partition_prefix.size() ||
+            std::memcmp(p, partition_prefix.data(), partition_prefix.size()))
+          continue;
+        auto digits = p + partition_prefix.size();
+        auto q = digits;
+        uint64_t hash = 0;
+        while (q < end && *q >= '0' && *q <= '9' && q - digits < 19)
+          hash = hash * 10 + (*q++ - '0');
+        if (q == digits || (q < end && word[uint8_t(*q)]) ||
+            hash >= partition.names.size() || partition.names[hash].empty())
+          continue;
+        output.append(copied, p);
+        output += name(partition, hash);
+        copied = q;
+        p = q - 1;
+        break;
+      }
+    }
+    output.append(copied, end);
+  }
+
+  const std::string &name(Partition &partition, uint64_t hash) {
+    if (!demangle)
+      return partition.names[hash];
+    if (partition.demangled.empty())
+      partition.demangled.resize(partition.names.size());
+    auto &demangled = partition.demangled[hash];
+    if (demangled.empty())
+      demangled = demangler(partition.names[hash]);
+    return demangled;
+  }
+
+  // The next byte that may start a hashed name.  Bytes are compared sixteen
+  // at a time against the first byte of every prefix, or found with memchr
+  // where all prefixes start alike.
+  const char *find_start(const char *p, const char *end) const {
+    if (firsts.size() == 1)
+      return static_cast<const char *>(std::memchr(p, firsts[0], end - p));
+#ifdef __SSE2__
+    for (; end - p >= 16; p += 16) {
+      auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+      auto hits = _mm_setzero_si128();
+      for (auto first : firsts)
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(first)));
+      if (auto mask = _mm_movemask_epi8(hits))
+        return p + __builtin_ctz(mask);
+    }
+#endif
+    for (; p < end; p++)
+      if (starts[uint8_t(*p)])
+        return p;
+    return nullptr;
+  }
+
+  // Bytes that continue an identifier
+  static constexpr auto word = []() {
+    std::array<bool, 256> table = {};
+    for (int c = 0; c < 256; c++)
+      table[c] = (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') ||
+                 (c >= 'A' && c <= 'Z') || c == '_';
+    return table;
+  }();
+
+  bool demangle;
+  std::vector<Partition> partitions;
+  std::array<bool, 256> starts = {};
+  std::vector<char> firsts;
+};
+
+// Opens text to dehash, where "-" is standard input
+int open_text(const std::filesystem::path &path) {
+  if (is_stdio(path))
+    return STDIN_FILENO;
+  auto fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    throw std::logic_error("Could not open " + path.string());
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  return fd;
+}
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_TEXT_H_
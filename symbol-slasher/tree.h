@@ -0,0 +1,152 @@
+/* tree.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_TREE_H_
+#define SYMBOL_SLASHER_TREE_H_
+
+#include "pool.h"
+#include "sniff.h"
+#include <filesystem>
+#include <map>
+#include <string>
+#include <sys/stat.h>
+#include <utility>
+#include <vector>
+
+namespace slasher {
+
+// A file found while walking a directory, relative to the directory
+struct Tree_entry {
+  // ELF files and static archives are both reported as elf
+  enum Kind { directory, symlink, hardlink, elf, file };
+
+  std::filesystem::path path;
+  Kind kind;
+
+  // Target of a symlink, or the first path of a hardlinked file
+  std::filesystem::path target;
+};
+
+// Walks a directory without following symlinks.  Each inode is reported once;
+// later paths to the same inode are reported as hardlinks to the first.
+std::vector<Tree_entry> walk_tree(const std::filesystem::path &root,
+                                  unsigned jobs) {
+  std::vector<Tree_entry> entries;
+  std::map<std::pair<dev_t, ino_t>, std::filesystem::path> inodes;
+  for (const auto &entry : std::filesystem::recursive_directory_iterator(root)) {
+    auto relative = entry.path().lexically_relative(root);
+    if (entry.is_symlink()) {
+      entries.push_back({relative, Tree_entry::symlink,
+                         std::filesystem::read_symlink(entry.path())});
+    } else if (entry.is_directory()) {
+      entries.push_back({relative, Tree_entry::directory, {}});
+    } else if (entry.is_regular_file()) {
+      struct stat info;
+      if (::lstat(entry.path().c_str(), &info) != 0)
+        throw std::logic_error("failed to stat " + entry.path().string());
+      auto [first, inserted] =
+          inodes.emplace(std::make_pair(info.st_dev, info.st_ino), relative);
+      if (inserted)
+        entries.push_back({relative, Tree_entry::file, {}});
+      else
+        entries.push_back({relative, Tree_entry::hardlink, first->second});
+    }
+  }
+
+  // Reading the magic is the only part that touches file contents
+  parallel_for(entries.size(), jobs, [&](std::size_t i) {
+    if (entries[i].kind == Tree_entry::file &&
+        (is_elf(root / entries[i].path) || is_archive(root / entries[i].path)))
+      entries[i].kind = Tree_entry::elf;
+  });
+  return entries;
+}
+
+// Replaces directories in a list of object paths with the ELF files and
+// archives they contain
+std::vector<std::string> expand_objects(const std::vector<std::string> &paths,
+                                        unsigned jobs) {
+  std::vector<std::string> objects;
+  for (const auto &path : paths) {
+    if (!std::filesystem::is_directory(path)) {
+      objects.push_back(path);
+      continue;
+    }
+    for (const auto &entry : walk_tree(path, jobs))
+      if (entry.kind == Tree_entry::elf)
+        objects.push_back((std::filesystem::path(path) / entry.path).string());
+  }
+  return objects;
+}
+
+// Mirrors input directories into output directories.  Directories, symlinks
+// and files that are not ELF or archives are recreated as they are, objects
+// are left to the caller, and hardlinks are recreated once the caller has
+// written the files they link to.
+struct Mirror {
+  void add(const std::string &in_path, const std::string &out_path,
+           unsigned jobs) {
+    if (!std::filesystem::is_directory(in_path)) {
+      objects.emplace_back(in_path, out_path);
+      return;
+    }
+    std::filesystem::path in_root(in_path), out_root(out_path);
+    std::filesystem::create_directories(out_root);
+    for (const auto &entry : walk_tree(in_root, jobs)) {
+      auto in = in_root / entry.path, out = out_root / entry.path;
+      switch (entry.kind) {
+      case Tree_entry::directory:
+        std::filesystem::create_directories(out);
+        break;
+      case Tree_entry::symlink:
+        std::filesystem::remove(out);
+        std::filesystem::create_symlink(entry.target, out);
+        break;
+      case Tree_entry::hardlink:
+        hardlinks.emplace_back(out_root / entry.target, out);
+        break;
+      case Tree_entry::elf:
+        objects.emplace_back(in.string(), out.string());
+        break;
+      case Tree_entry::file:
+        std::filesystem::copy_file(
+            in, out, std::filesystem::copy_options::overwrite_existing);
+        break;
+      }
+    }
+  }
+
+  void link() {
+    for (const auto &[target, link] : hardlinks) {
+      std::filesystem::remove(link);
+      std::filesystem::create_hard_link(target, link);
+    }
+  }
+
+  // ELF files and archives to process, as input and output paths
+  std::vector<std::pair<std::string, std::string>> objects;
+
+private:
+  std::vector<std::pair<std::filesystem::path, std::filesystem::path>>
+      hardlinks;
+};
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_TREE_H_
@@ -0,0 +1,143 @@
+/* watch.h
+Copyright (C) 2018 Caleb Zulawski
+
+This file is part of Symbol Slasher.
+
+Symbol Slasher is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+Symbol Slasher is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with Symbol Slasher.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef SYMBOL_SLASHER_WATCH_H_
+#define SYMBOL_SLASHER_WATCH_H_
+
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <filesystem>
+#include <poll.h>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace slasher {
+
+// Set by SIGINT and SIGTERM, so a watch can stop between batches and write
+// what it holds
+volatile std::sig_atomic_t watch_stopped = 0;
+
+void stop_watching() {
+  struct sigaction action = {};
+  action.sa_handler = [](int) { watch_stopped = 1; };
+  // Without SA_RESTART, so a blocked poll returns
+  ::sigaction(SIGINT, &action, nullptr);
+  ::sigaction(SIGTERM, &action, nullptr);
+}
+
+// Watches directory trees for files that are written or moved into place
+struct Watcher {
+  Watcher() : fd(::inotify_init1(IN_CLOEXEC | IN_NONBLOCK)) {
+    if (fd < 0)
+      throw std::logic_error("Could not start watching for changes");
+  }
+
+  Watcher(const Watcher &) = delete;
+
+  ~Watcher() { ::close(fd); }
+
+  // Watches a directory and every directory below it
+  void add(const std::filesystem::path &root) {
+    add_directory(root);
+    for (const auto &entry : std::filesystem::recursive_directory_iterator(root))
+      if (entry.is_directory() && !entry.is_symlink())
+        add_directory(entry.path());
+  }
+
+  // Waits for a burst of changes, and returns the files that were written,
+  // once no change has been seen for quiet.  Directories created during the
+  // burst are watched, and the files already in them are returned.  Returns
+  // an empty set if the watch was stopped.
+  std::set<std::filesystem::path> wait(std::chrono::milliseconds quiet) {
+    std::set<std::filesystem::path> changed;
+    int timeout = -1;
+    while (!watch_stopped) {
+      pollfd poll_fd = {fd, POLLIN, 0};
+      auto ready = ::poll(&poll_fd, 1, timeout);
+      if (ready < 0 && errno != EINTR)
+        throw std::logic_error("Could not wait for changes");
+      if (ready == 0 && !changed.empty())
+        break;
+      if (ready > 0)
+        read_events(changed);
+      // Once something changed, wait only until the burst is over
+      if (!changed.empty())
+        timeout = quiet.count();
+    }
+    if (watch_stopped)
+      changed.clear();
+    return changed;
+  }
+
+private:
+  void add_directory(const std::filesystem::path &dir) {
+    auto wd = ::inotify_add_watch(fd, dir.c_str(),
+                                  IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE |
+                                      IN_ONLYDIR);
+    if (wd < 0)
+      throw std::logic_error("Could not watch " + dir.string());
+    dirs[wd] = dir;
+  }
+
+  void read_events(std::set<std::filesystem::path> &changed) {
+    alignas(inotify_event) char buffer[1 << 16];
+    for (;;) {
+      auto size = ::read(fd, buffer, sizeof(buffer));
+      if (size <= 0)
+        return;
+      for (char *p = buffer; p < buffer + size;) {
+        auto event = reinterpret_cast<inotify_event *>(p);
+        p += sizeof(inotify_event) + event->len;
+        auto dir = dirs.find(event->wd);
+        if (dir == dirs.end() || event->len == 0)
+          continue;
+        auto path = dir->second / event->name;
+        if (event->mask & IN_ISDIR) {
+          if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+            // Files may already have been written before the watch started
+            try {
+              add(path);
+              for (const auto &entry :
+                   std::filesystem::recursive_directory_iterator(path))
+                if (entry.is_regular_file() && !entry.is_symlink())
+                  changed.insert(entry.path());
+            } catch (const std::exception &) {
+              // Removed again before it could be watched
+            }
+          }
+        } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+          changed.insert(path);
+        }
+      }
+    }
+  }
+
+  int fd;
+  std::unordered_map<int, std::filesystem::path> dirs;
+};
+
+} // namespace slasher
+
+#endif // SYMBOL_SLASHER_WATCH_H_